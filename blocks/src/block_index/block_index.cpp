@@ -0,0 +1,509 @@
+#include "block_index.hpp"
+
+#include <string>
+#include <algorithm>
+#include <iterator>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME  1099511628211ULL
+
+static const char index_magic[8] = "BLKIDX2";
+
+const char * const block_index::suffix = ".blkidx";
+
+static int64_t mtime_ns(const struct stat& st)
+{
+	return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000
+		+ st.st_mtim.tv_nsec;
+}
+
+static inline uint32_t fold_case(unsigned char ch)
+{
+	return ('A' <= ch && ch <= 'Z') ? ch - 'A' + 'a' : ch;
+}
+
+static inline uint32_t trigram(const char * str)
+{
+	const unsigned char * bytes = reinterpret_cast<const unsigned char *>(str);
+	return (fold_case(bytes[0]) << 16)
+		| (fold_case(bytes[1]) << 8)
+		| fold_case(bytes[2]);
+}
+
+static std::runtime_error write_error(const std::string& fname)
+{
+	return std::runtime_error(
+		std::string("cannot write index ").append(fname).append(": ")
+			.append(strerror(errno))
+	);
+}
+
+block_index::hasher::hasher() :
+	m_hash(FNV_OFFSET)
+{}
+
+void block_index::hasher::add(const char * str)
+{
+	// the terminator too, so "ab" "c" and "a" "bc" differ
+	str = str ? str : "";
+	p_add(str, strlen(str)+1);
+}
+
+void block_index::hasher::add(uint64_t num)
+{
+	p_add(&num, sizeof(num));
+}
+
+void block_index::hasher::p_add(const void * data, size_t len)
+{
+	const unsigned char * bytes = static_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < len; ++i)
+	{
+		m_hash ^= bytes[i];
+		m_hash *= FNV_PRIME;
+	}
+}
+
+void block_index::writer::take_source(const char * fname)
+{
+	struct stat st;
+	m_has_src = (0 == stat(fname, &st));
+	m_src_size = m_has_src ? st.st_size : 0;
+	m_src_mtime_ns = m_has_src ? mtime_ns(st) : 0;
+	m_src_ino = m_has_src ? st.st_ino : 0;
+}
+
+bool block_index::writer::write(const char * fname, const char * idx_name)
+{
+	struct stat st;
+	if (stat(fname, &st) != 0)
+		throw write_error(fname);
+
+	// changed while it was read; the entries may be of neither version
+	if (!m_has_src || m_src_size != static_cast<uint64_t>(st.st_size)
+		|| m_src_mtime_ns != mtime_ns(st)
+		|| m_src_ino != static_cast<uint64_t>(st.st_ino))
+	{
+		return false;
+	}
+
+	m_tri_keys.clear();
+	m_tri_firsts.clear();
+	m_posts.clear();
+	if (m_with_trigrams)
+	{
+		const void * data = nullptr;
+		size_t size = 0;
+		int64_t mtime = 0;
+		uint64_t ino = 0;
+
+		if (!p_map(fname, &data, &size, &mtime, &ino))
+			throw write_error(fname);
+
+		if (size != m_src_size || mtime != m_src_mtime_ns || ino != m_src_ino)
+		{
+			if (data)
+				munmap(const_cast<void *>(data), size);
+			return false;
+		}
+
+		p_make_trigrams(static_cast<const char *>(data), size);
+		if (data)
+			munmap(const_cast<void *>(data), size);
+	}
+
+	p_header hdr;
+	memcpy(hdr.magic, index_magic, sizeof(hdr.magic));
+	hdr.config_hash = m_config_hash;
+	hdr.file_size = st.st_size;
+	hdr.file_mtime_ns = mtime_ns(st);
+	hdr.file_ino = st.st_ino;
+	hdr.count = m_entries.size();
+	hdr.has_trigrams = m_with_trigrams;
+	hdr.tri_count = m_tri_keys.size();
+	hdr.post_count = m_posts.size();
+
+	// written aside and renamed, so a reader never sees half an index; the
+	// pid keeps runs at the same time apart
+	std::string out_name(idx_name ? idx_name : fname);
+	if (!idx_name)
+		out_name.append(suffix);
+	std::string tmp_name(out_name);
+	tmp_name.append(".tmp").append(std::to_string(getpid()));
+
+	FILE * out = fopen(tmp_name.c_str(), "wb");
+	if (!out)
+		throw write_error(out_name);
+
+	bool is_ok = (fwrite(&hdr, sizeof(hdr), 1, out) == 1
+		&& fwrite(m_entries.data(), sizeof(entry), m_entries.size(), out)
+			== m_entries.size());
+
+	if (is_ok && m_with_trigrams)
+	{
+		is_ok = (fwrite(m_tri_firsts.data(), sizeof(uint64_t),
+				m_tri_firsts.size(), out) == m_tri_firsts.size()
+			&& fwrite(m_tri_keys.data(), sizeof(uint32_t),
+				m_tri_keys.size(), out) == m_tri_keys.size()
+			&& fwrite(m_posts.data(), sizeof(uint32_t),
+				m_posts.size(), out) == m_posts.size());
+	}
+
+	is_ok = (0 == fclose(out)) && is_ok;
+	if (!is_ok || rename(tmp_name.c_str(), out_name.c_str()) != 0)
+	{
+		int err = errno;
+		remove(tmp_name.c_str());
+		errno = err;
+		throw write_error(out_name);
+	}
+	return true;
+}
+
+void block_index::writer::p_make_trigrams(const char * data, size_t size)
+{
+	if (m_entries.size() > UINT32_MAX)
+		throw std::runtime_error("too many blocks for a trigram index");
+
+	// trigram << 32 | block, every trigram once per block
+	std::vector<uint64_t> pairs;
+	std::vector<uint32_t> tris;
+	size_t start = 0;
+	size_t end = 0;
+
+	for (size_t i = 0, count = m_entries.size(); i < count; ++i)
+	{
+		whole_lines(data, size, m_entries[i], &start, &end);
+
+		// lines are matched one at a time, so no trigram spans two
+		tris.clear();
+		for (size_t j = start; j+3 <= end; ++j)
+		{
+			if (!memchr(data + j, '\n', 3))
+				tris.push_back(trigram(data + j));
+		}
+
+		std::sort(tris.begin(), tris.end());
+		tris.erase(std::unique(tris.begin(), tris.end()), tris.end());
+		for (uint32_t tri : tris)
+			pairs.push_back((static_cast<uint64_t>(tri) << 32) | i);
+	}
+
+	std::sort(pairs.begin(), pairs.end());
+
+	uint32_t key = 0;
+	for (uint64_t pair : pairs)
+	{
+		key = static_cast<uint32_t>(pair >> 32);
+		if (m_tri_keys.empty() || m_tri_keys.back() != key)
+		{
+			m_tri_keys.push_back(key);
+			m_tri_firsts.push_back(m_posts.size());
+		}
+		m_posts.push_back(static_cast<uint32_t>(pair));
+	}
+	m_tri_firsts.push_back(m_posts.size());
+}
+
+block_index::block_index() :
+	m_index(nullptr),
+	m_entries(nullptr),
+	m_tri_keys(nullptr),
+	m_tri_firsts(nullptr),
+	m_posts(nullptr),
+	m_data(nullptr),
+	m_index_size(0),
+	m_data_size(0),
+	m_count(0),
+	m_tri_count(0),
+	m_post_count(0),
+	m_idx_mtime_ns(0),
+	m_idx_ino(0),
+	m_has_trigrams(false)
+{}
+
+block_index::~block_index()
+{
+	close();
+}
+
+bool block_index::open(
+	const char * fname,
+	uint64_t config_hash,
+	const char * idx_name
+)
+{
+	close();
+
+	std::string in_name(idx_name ? idx_name : fname);
+	if (!idx_name)
+		in_name.append(suffix);
+
+	int64_t data_mtime = 0;
+	int64_t idx_mtime = 0;
+	uint64_t data_ino = 0;
+	uint64_t idx_ino = 0;
+	const void * data = nullptr;
+
+	if (!p_map(in_name.c_str(), &m_index, &m_index_size, &idx_mtime, &idx_ino))
+		return false;
+
+	// counts too big for the index would overflow its size
+	const p_header * hdr = static_cast<const p_header *>(m_index);
+	bool is_good = (m_index_size >= sizeof(*hdr)
+		&& 0 == memcmp(hdr->magic, index_magic, sizeof(hdr->magic))
+		&& hdr->config_hash == config_hash
+		&& hdr->count <= m_index_size / sizeof(entry)
+		&& hdr->tri_count < m_index_size / sizeof(uint64_t)
+		&& hdr->post_count <= m_index_size / sizeof(uint32_t)
+		&& m_index_size == p_index_size(*hdr)
+		&& p_map(fname, &data, &m_data_size, &data_mtime, &data_ino)
+		&& hdr->file_size == m_data_size
+		&& hdr->file_mtime_ns == data_mtime
+		&& hdr->file_ino == data_ino);
+
+	m_data = static_cast<const char *>(data);
+	if (!is_good)
+	{
+		close();
+		return false;
+	}
+
+	m_count = hdr->count;
+	m_entries = reinterpret_cast<const entry *>(hdr+1);
+	m_idx_mtime_ns = idx_mtime;
+	m_idx_ino = idx_ino;
+	m_has_trigrams = hdr->has_trigrams;
+	if (m_has_trigrams)
+	{
+		m_tri_count = hdr->tri_count;
+		m_post_count = hdr->post_count;
+		m_tri_firsts = reinterpret_cast<const uint64_t *>(m_entries + m_count);
+		m_tri_keys = reinterpret_cast<const uint32_t *>(
+			m_tri_firsts + m_tri_count+1
+		);
+		m_posts = m_tri_keys + m_tri_count;
+
+		// keys have to be sorted for the search, lists inside the posts
+		bool is_sorted = (0 == m_tri_firsts[0]
+			&& m_post_count == m_tri_firsts[m_tri_count]);
+		for (size_t i = 0; is_sorted && i < m_tri_count; ++i)
+		{
+			is_sorted = (m_tri_firsts[i] <= m_tri_firsts[i+1]
+				&& (0 == i || m_tri_keys[i-1] < m_tri_keys[i]));
+		}
+
+		if (!is_sorted)
+		{
+			close();
+			return false;
+		}
+	}
+
+	// don't trust offsets past the end of the file
+	for (size_t i = 0; i < m_count; ++i)
+	{
+		const entry& ent = m_entries[i];
+		if (ent.name_byte > ent.open_byte
+			|| ent.name_byte > ent.name_end_byte
+			|| ent.name_end_byte > ent.close_end_byte
+			|| ent.open_byte >= ent.close_end_byte
+			|| ent.close_end_byte > m_data_size)
+		{
+			close();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void block_index::close()
+{
+	if (m_index)
+		munmap(const_cast<void *>(m_index), m_index_size);
+
+	if (m_data)
+		munmap(const_cast<char *>(m_data), m_data_size);
+
+	m_index = nullptr;
+	m_entries = nullptr;
+	m_tri_keys = nullptr;
+	m_tri_firsts = nullptr;
+	m_posts = nullptr;
+	m_data = nullptr;
+	m_index_size = 0;
+	m_data_size = 0;
+	m_count = 0;
+	m_tri_count = 0;
+	m_post_count = 0;
+	m_idx_mtime_ns = 0;
+	m_idx_ino = 0;
+	m_has_trigrams = false;
+}
+
+bool block_index::is_current(const char * fname, const char * idx_name) const
+{
+	if (!m_index)
+		return false;
+
+	std::string in_name(idx_name ? idx_name : fname);
+	if (!idx_name)
+		in_name.append(suffix);
+
+	struct stat st;
+	struct stat idx_st;
+	const p_header * hdr = static_cast<const p_header *>(m_index);
+	return (0 == stat(fname, &st) && 0 == stat(in_name.c_str(), &idx_st)
+		&& hdr->file_size == static_cast<uint64_t>(st.st_size)
+		&& hdr->file_mtime_ns == mtime_ns(st)
+		&& hdr->file_ino == st.st_ino
+		&& m_idx_mtime_ns == mtime_ns(idx_st)
+		&& m_idx_ino == idx_st.st_ino);
+}
+
+bool block_index::candidates(
+	const std::vector<std::string>& literals,
+	std::vector<uint32_t>& out
+) const
+{
+	if (!m_has_trigrams)
+		return false;
+
+	const uint32_t * begin = nullptr;
+	const uint32_t * end = nullptr;
+	std::vector<uint32_t> both;
+	bool is_any = false;
+
+	out.clear();
+	for (const auto& lit : literals)
+	{
+		for (size_t i = 0; i+3 <= lit.length(); ++i)
+		{
+			// a trigram no block has
+			if (!p_posts(trigram(lit.c_str() + i), &begin, &end))
+			{
+				out.clear();
+				return true;
+			}
+
+			if (!is_any)
+			{
+				out.assign(begin, end);
+				is_any = true;
+			}
+			else
+			{
+				both.clear();
+				std::set_intersection(out.begin(), out.end(), begin, end,
+					std::back_inserter(both));
+				out.swap(both);
+			}
+
+			if (out.empty())
+				return true;
+		}
+	}
+
+	if (!is_any)
+		return false;
+
+	// don't trust block numbers past the last block
+	out.erase(std::lower_bound(out.begin(), out.end(), m_count), out.end());
+	return true;
+}
+
+void block_index::whole_lines(
+	const char * data,
+	size_t size,
+	const entry& ent,
+	size_t * out_start,
+	size_t * out_end
+)
+{
+	size_t start = ent.name_byte;
+	while (start > 0 && '\n' != data[start-1])
+		--start;
+
+	const char * nl = static_cast<const char *>(
+		memchr(data + ent.close_end_byte, '\n', size - ent.close_end_byte)
+	);
+
+	*out_start = start;
+	*out_end = nl ? nl - data : size;
+}
+
+size_t block_index::p_index_size(const p_header& hdr)
+{
+	size_t size = sizeof(hdr) + hdr.count * sizeof(entry);
+	if (hdr.has_trigrams)
+	{
+		size += (hdr.tri_count+1) * sizeof(uint64_t)
+			+ (hdr.tri_count + hdr.post_count) * sizeof(uint32_t);
+	}
+	return size;
+}
+
+bool block_index::p_posts(
+	uint32_t key,
+	const uint32_t ** out_begin,
+	const uint32_t ** out_end
+) const
+{
+	const uint32_t * keys_end = m_tri_keys + m_tri_count;
+	const uint32_t * found = std::lower_bound(m_tri_keys, keys_end, key);
+	if (keys_end == found || *found != key)
+		return false;
+
+	size_t i = found - m_tri_keys;
+	*out_begin = m_posts + m_tri_firsts[i];
+	*out_end = m_posts + m_tri_firsts[i+1];
+	return true;
+}
+
+bool block_index::p_map(
+	const char * fname,
+	const void ** out,
+	size_t * out_size,
+	int64_t * out_mtime_ns,
+	uint64_t * out_ino
+)
+{
+	*out = nullptr;
+	*out_size = 0;
+
+	int fd = ::open(fname, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	bool is_ok = (0 == fstat(fd, &st) && S_ISREG(st.st_mode));
+	if (is_ok)
+	{
+		*out_size = st.st_size;
+		*out_mtime_ns = mtime_ns(st);
+		*out_ino = st.st_ino;
+
+		// an empty file has nothing to map
+		if (*out_size)
+		{
+			void * mem = mmap(nullptr, *out_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (MAP_FAILED == mem)
+				is_ok = false;
+			else
+				*out = mem;
+		}
+	}
+
+	::close(fd);
+	return is_ok;
+}
@@ -0,0 +1,187 @@
+#ifndef BLOCK_INDEX_HPP
+#define BLOCK_INDEX_HPP
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+// A file next to an input file which says where every block in it is, so a
+// query with the same lexer configuration can go straight to the blocks
+// instead of lexing the file. An index is good only for the size and the
+// modification time and the inode of the file it was made from, and for the
+// configuration hash it was made with; the file and the index are both mapped
+// to memory. An index can be kept elsewhere under a name of the caller's.
+// An index can also have a posting list of blocks for every trigram in their
+// lines, so only the blocks which can have some text in them are read.
+class block_index
+{
+public:
+	// appended to the input file name
+	static const char * const suffix;
+
+	struct entry
+	{
+		uint64_t name_byte;
+		uint64_t name_end_byte;
+		uint64_t open_byte;
+		uint64_t close_end_byte;
+		uint64_t first_line;
+		uint64_t last_line;
+		uint64_t depth;
+	};
+
+	// FNV-1a over everything the tokens of a file depend on
+	class hasher
+	{
+	public:
+		hasher();
+		void add(const char * str);
+		void add(uint64_t num);
+
+		uint64_t get() const
+		{return m_hash;}
+
+	private:
+		void p_add(const void * data, size_t len);
+
+	private:
+		uint64_t m_hash;
+	};
+
+	class writer
+	{
+	public:
+		writer(uint64_t config_hash, bool with_trigrams = false) :
+			m_config_hash(config_hash),
+			m_src_size(0),
+			m_src_mtime_ns(0),
+			m_src_ino(0),
+			m_with_trigrams(with_trigrams),
+			m_has_src(false)
+		{}
+
+		void reset()
+		{m_entries.clear();}
+
+		void add(const entry& ent)
+		{m_entries.push_back(ent);}
+
+		// what fname is before it's opened to be read, so the index is
+		// written only for what was read
+		void take_source(const char * fname);
+
+		// the index of fname, next to it unless idx_name is given; false and
+		// nothing written if fname is not what take_source() saw; throws
+		// std::runtime_error
+		bool write(const char * fname, const char * idx_name = nullptr);
+
+		uint64_t get_config_hash() const
+		{return m_config_hash;}
+
+	private:
+		void p_make_trigrams(const char * data, size_t size);
+
+	private:
+		std::vector<entry> m_entries;
+		std::vector<uint32_t> m_tri_keys;
+		std::vector<uint64_t> m_tri_firsts;
+		std::vector<uint32_t> m_posts;
+		uint64_t m_config_hash;
+		uint64_t m_src_size;
+		int64_t m_src_mtime_ns;
+		uint64_t m_src_ino;
+		bool m_with_trigrams;
+		bool m_has_src;
+	};
+
+public:
+	block_index();
+	~block_index();
+
+	// false if fname has no index, or it's not good for config_hash or for
+	// the file as it is now
+	bool open(
+		const char * fname,
+		uint64_t config_hash,
+		const char * idx_name = nullptr
+	);
+	void close();
+
+	// fname and the index of it are still as they were when it was opened,
+	// so what's mapped of them can be used again; false when not open
+	bool is_current(const char * fname, const char * idx_name = nullptr) const;
+
+	size_t size() const
+	{return m_count;}
+
+	const entry& get(size_t i) const
+	{return m_entries[i];}
+
+	// the input file
+	const char * data() const
+	{return m_data;}
+
+	size_t data_size() const
+	{return m_data_size;}
+
+	bool has_trigrams() const
+	{return m_has_trigrams;}
+
+	// the blocks which can have every literal in their lines, in file order;
+	// false if the index has no trigrams or no literal is long enough to
+	// tell, case is not told apart
+	bool candidates(
+		const std::vector<std::string>& literals,
+		std::vector<uint32_t>& out
+	) const;
+
+	// the whole lines of ent in data, without the new line after the last
+	static void whole_lines(
+		const char * data,
+		size_t size,
+		const entry& ent,
+		size_t * out_start,
+		size_t * out_end
+	);
+
+private:
+	struct p_header
+	{
+		char magic[8];
+		uint64_t config_hash;
+		uint64_t file_size;
+		int64_t file_mtime_ns;
+		uint64_t file_ino;
+		uint64_t count;
+		uint64_t has_trigrams;
+		uint64_t tri_count;
+		uint64_t post_count;
+	};
+
+	// trigram posting lists follow the entries: tri_count+1 firsts into the
+	// posts, tri_count sorted keys, and post_count block numbers
+	static size_t p_index_size(const p_header& hdr);
+	bool p_posts(uint32_t key, const uint32_t ** out_begin,
+		const uint32_t ** out_end) const;
+
+	static bool p_map(const char * fname, const void ** out, size_t * out_size,
+		int64_t * out_mtime_ns, uint64_t * out_ino);
+
+private:
+	const void * m_index;
+	const entry * m_entries;
+	const uint32_t * m_tri_keys;
+	const uint64_t * m_tri_firsts;
+	const uint32_t * m_posts;
+	const char * m_data;
+	size_t m_index_size;
+	size_t m_data_size;
+	size_t m_count;
+	size_t m_tri_count;
+	size_t m_post_count;
+	int64_t m_idx_mtime_ns;
+	uint64_t m_idx_ino;
+	bool m_has_trigrams;
+};
+#endif
@@ -1,23 +1,83 @@
 #include "block_parser.hpp"
 
 #include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+#define ARENA_CHUNK_MIN 4096
+#define ARENA_KEEP_MAX  (4*1024*1024)
 
 void block_parser::init(const char * fname)
 {
 	m_lexer.reset();
 	m_fname = fname;
+	m_resume_byte = m_lexer.start_byte();
+	m_resume_line = m_lexer.start_line()+1;
 }
 
 bool block_parser::parse_block()
 {
-	p_clear_block();
-	p_clear_error();
-	bool has_block_start = p_find_block_name();
+	bool has_block_start = false;
+	range_pos where = R_IN;
 
-	if (has_block_start && !(p_find_block_open() && p_get_block_body()))
-		p_error_report_generate();
+	do
+	{
+		p_clear_block();
+		p_clear_error();
+		has_block_start = p_find_block_name();
+		if (!has_block_start)
+			break;
 
-	return has_block_start;
+		if (!p_find_block_open())
+		{
+			where = p_range_pos();
+			if (R_IN == where)
+				p_error_report_generate();
+		}
+		else
+		{
+			where = p_range_pos();
+			if (R_AFTER == where)
+				break;
+
+			m_block.start(R_IN == where ? m_sink : &m_skip_sink);
+
+			bool is_ok = p_get_block_body();
+			if (!is_ok)
+			{
+				if (R_IN == where)
+					p_error_report_generate();
+			}
+			else
+			{
+				m_block.set_end(m_lexer.line_pos());
+				m_resume_byte = m_span.close_end_byte;
+				m_resume_line = m_span.last_line;
+			}
+
+			m_block.end(is_ok);
+		}
+	} while (R_BEFORE == where);
+
+	return (has_block_start && R_AFTER != where);
+}
+
+block_parser::range_pos block_parser::p_range_pos()
+{
+	if (m_span.name_byte < m_range.first_byte
+		|| m_span.first_line < m_range.first_line)
+	{
+		return R_BEFORE;
+	}
+
+	if (m_span.name_byte >= m_range.end_byte
+		|| m_span.first_line > m_range.last_line)
+	{
+		return R_AFTER;
+	}
+
+	return R_IN;
 }
 
 bool block_parser::p_get_block_body()
@@ -26,10 +86,15 @@ bool block_parser::p_get_block_body()
 	size_t stack = 0;
 	lexer::tok which = lexer::tok::NONE;
 
+	size_t max_stack = 0;
+
 	while (p_find_open_or_close(&which))
 	{
 		if (lexer::tok::OPEN == which)
-			++stack;
+		{
+			if (++stack > max_stack)
+				max_stack = stack;
+		}
 		else if (lexer::tok::CLOSE == which)
 		{
 			if (!stack)
@@ -40,7 +105,12 @@ bool block_parser::p_get_block_body()
 	}
 
 	if (!stack)
+	{
 		ret = true;
+		m_span.close_end_byte = m_lexer.byte_pos();
+		m_span.last_line = m_lexer.line_num();
+		m_span.depth = max_stack ? max_stack-1 : 0;
+	}
 out:
 	return ret;
 }
@@ -84,10 +154,19 @@ bool block_parser::p_find_block_open()
 
 			case lexer::tok::NAME:
 			{
+				// the block starts at the closest name to the open
 				p_clear_block();
+				p_save_line_unique(which);
+				m_block.set_begin(m_lexer.line_pos());
+				m_span.name_byte = m_lexer.byte_pos();
+				m_span.name_end_byte = m_span.name_byte + m_lexer.match_len();
+				m_span.first_line = m_lexer.line_num();
+				m_name.assign(m_lexer.get_line(), m_lexer.line_pos(),
+					m_lexer.match_len());
 
 				if (m_lexer.also_matches_open())
 				{
+					m_span.open_byte = m_lexer.byte_pos();
 					found_block_open = true;
 					goto done;
 				}
@@ -100,6 +179,7 @@ bool block_parser::p_find_block_open()
 
 			case lexer::tok::OPEN:
 			{
+				m_span.open_byte = m_lexer.byte_pos();
 				found_block_open = true;
 				goto done;
 			} break;
@@ -141,37 +221,226 @@ bool block_parser::p_find_open_or_close(lexer::tok * out_which)
 
 void block_parser::p_error_report_generate()
 {
-	const std::vector<block_line>& block = m_block.get_content();
-	size_t first_line_no = block.front().get_line_no();
-	const std::string& bad_line = block.back().get_line();
+	size_t first_line_no = m_block.get_first_line_no();
+	const std::string bad_line(m_block.get_content().back().get_line());
 
 	m_error.create(
 		first_line_no,
 		bad_line,
 		m_fname,
 		m_lexer.line_num(),
-		m_lexer.line_pos()
+		m_lexer.line_pos(),
+		m_lexer.line_col()
 	);
 }
 
 void block_parser::parsed_block::save_line(
 	const char * txt,
+	size_t len,
+	size_t piece_num,
 	size_t line_num,
+	bool is_cont,
 	lexer::tok token
 )
 {
-	if (m_last_saved_line_no != line_num)
+	if (m_last_saved_piece_no != piece_num)
 	{
-		m_content.emplace_back(txt, line_num);
-		m_last_saved_line_no = line_num;
+		if (m_sink && LM_SKIP != m_mode)
+			p_line_done(m_content.back());
+
+		if (LM_STORE != m_mode)
+		{
+			m_content.clear();
+			m_text.reset();
+			m_mem = 0;
+		}
+		else if (m_max_mem && m_is_started && m_mem > m_max_mem)
+		{
+			// only lines of the body; the head is seen by the sink first
+			p_spill();
+		}
+
+		if (!m_first_line_no)
+			m_first_line_no = line_num;
+
+		m_content.emplace_back(m_text.save(txt, len), len, line_num);
+		m_content.back().set_continues(is_cont);
+		m_mem += len + 1 + sizeof(block_line);
+		m_last_saved_piece_no = piece_num;
 	}
 	m_content.back().mark_token(token);
 }
 
+block_parser::parsed_block::~parsed_block()
+{
+	if (m_spill)
+		fclose(m_spill);
+}
+
 void block_parser::parsed_block::reset()
 {
 	m_content.clear();
-	m_last_saved_line_no = 0;
+	m_text.reset();
+	m_sink = nullptr;
+	m_spilled = 0;
+	m_mem = 0;
+	m_first_line_no = 0;
+	m_last_saved_piece_no = 0;
+	m_mode = LM_STORE;
+	m_is_started = false;
+}
+
+void block_parser::parsed_block::start(line_sink * sink)
+{
+	m_is_started = true;
+	if (!(m_sink = sink))
+		return;
+
+	m_mode = m_sink->block_start(m_content);
+
+	// all but the open line are finished
+	for (size_t i = 0, end = m_content.size()-1; i < end; ++i)
+	{
+		if (LM_SKIP == m_mode)
+			break;
+		p_line_done(m_content[i]);
+	}
+
+	if (LM_STORE != m_mode)
+		p_keep_last_only();
+}
+
+void block_parser::parsed_block::end(bool is_ok)
+{
+	if (m_sink)
+		m_sink->block_end(is_ok ? &m_content.back() : nullptr);
+}
+
+void block_parser::parsed_block::visit(line_visitor& vis)
+{
+	if (m_spilled)
+	{
+		p_spill_rec rec;
+
+		rewind(m_spill);
+		for (size_t i = 0; i < m_spilled; ++i)
+		{
+			if (fread(&rec, sizeof(rec), 1, m_spill) != 1)
+				throw std::runtime_error("cannot read the block back from disk");
+
+			m_spill_line.resize(rec.len);
+			if (rec.len
+				&& fread(&m_spill_line[0], 1, rec.len, m_spill) != rec.len)
+			{
+				throw std::runtime_error("cannot read the block back from disk");
+			}
+
+			block_line line(m_spill_line.c_str(), rec.len, rec.line_no,
+				rec.tok_mask);
+			line.set_begin(rec.begin);
+			line.set_end(rec.end);
+			line.set_continues(rec.is_cont);
+			vis.visit(line, false);
+		}
+	}
+
+	for (size_t i = 0, end = m_content.size(); i < end; ++i)
+		vis.visit(m_content[i], (i == end-1));
+}
+
+void block_parser::parsed_block::p_spill()
+{
+	// the file is anonymous and reused for every block
+	if (!m_spill && !(m_spill = tmpfile()))
+	{
+		throw std::runtime_error(
+			std::string("cannot create a file to spill the block to: ")
+				.append(strerror(errno))
+		);
+	}
+
+	if (!m_spilled)
+		rewind(m_spill);
+
+	p_spill_rec rec;
+	for (const auto& line : m_content)
+	{
+		rec.line_no = line.get_line_no();
+		rec.len = line.get_line_len();
+		rec.begin = line.get_begin();
+		rec.end = line.get_end();
+		rec.tok_mask = line.get_tok_mask();
+		rec.is_cont = line.continues();
+
+		if (fwrite(&rec, sizeof(rec), 1, m_spill) != 1
+			|| fwrite(line.get_line(), 1, rec.len, m_spill) != rec.len)
+		{
+			throw std::runtime_error(
+				std::string("cannot spill the block to disk: ")
+					.append(strerror(errno))
+			);
+		}
+	}
+
+	m_spilled += m_content.size();
+	m_content.clear();
+	m_text.reset();
+	m_mem = 0;
+}
+
+void block_parser::parsed_block::p_line_done(const block_line& line)
+{
+	m_mode = m_sink->block_line_done(line);
+}
+
+void block_parser::parsed_block::p_keep_last_only()
+{
+	// the text stays where it is in the arena until the next line is saved
+	if (m_content.size() > 1)
+		m_content.erase(m_content.begin(), m_content.end()-1);
+}
+
+const char * block_parser::arena::save(const char * txt, size_t len)
+{
+	size_t need = len+1;
+
+	while (m_curr < m_chunks.size() && m_chunks[m_curr].size - m_used < need)
+	{
+		++m_curr;
+		m_used = 0;
+	}
+
+	if (m_curr == m_chunks.size())
+	{
+		// grow geometrically so a big block needs only a few chunks
+		size_t size = m_chunks.empty() ? ARENA_CHUNK_MIN
+			: m_chunks.back().size * 2;
+		while (size < need)
+			size *= 2;
+		m_chunks.emplace_back(size);
+	}
+
+	char * dest = m_chunks[m_curr].data.get() + m_used;
+	memcpy(dest, txt, len);
+	dest[len] = '\0';
+	m_used += need;
+	return dest;
+}
+
+void block_parser::arena::reset()
+{
+	m_curr = 0;
+	m_used = 0;
+
+	// the chunks are smallest first; keep as many as fit in the cap
+	size_t kept = 0;
+	size_t keep = 0;
+	size_t end = m_chunks.size();
+	while (keep < end && kept + m_chunks[keep].size <= ARENA_KEEP_MAX)
+		kept += m_chunks[keep++].size;
+
+	if (keep < end)
+		m_chunks.erase(m_chunks.begin() + keep, m_chunks.end());
 }
 
 block_parser::error::error() :
@@ -187,7 +456,8 @@ void block_parser::error::create(
 	const std::string& bad_line_text,
 	const char * fname,
 	size_t lex_line_num,
-	size_t lex_line_pos
+	size_t lex_line_pos,
+	size_t lex_line_col
 )
 {
 	reset();
@@ -199,7 +469,7 @@ void block_parser::error::create(
 		err->append(fname).append(":");
 
 	err->append(std::to_string(lex_line_num)).append(":");
-	err->append(std::to_string(lex_line_pos+1));
+	err->append(std::to_string(lex_line_col+1));
 	err->append(": improper nesting from line ");
 	err->append(std::to_string(first_line_no));
 
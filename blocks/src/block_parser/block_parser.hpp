@@ -5,6 +5,9 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
 
 class block_parser
 {
@@ -12,10 +15,19 @@ public:
 	class block_line
 	{
 	public:
-		block_line(std::string line, size_t line_no) :
+		block_line(
+			const char * line,
+			size_t len,
+			size_t line_no,
+			uint32_t tok_mask = 0
+		) :
 			m_line(line),
+			m_len(len),
 			m_line_no(line_no),
-			m_tok_mask(0)
+			m_begin(0),
+			m_end(len),
+			m_tok_mask(tok_mask),
+			m_is_cont(false)
 		{}
 
 		void mark_token(lexer::tok token)
@@ -24,53 +36,266 @@ public:
 		bool has_token(lexer::tok token) const
 		{return (m_tok_mask & token);}
 
-		const std::string& get_line() const
+		// zero terminated; valid until the next block is parsed
+		const char * get_line() const
 		{return m_line;}
 
+		size_t get_line_len() const
+		{return m_len;}
+
 		size_t get_line_no() const
 		{return m_line_no;}
 
+		uint32_t get_tok_mask() const
+		{return m_tok_mask;}
+
+		// the block is [begin, end) of the line; it starts at the name on
+		// the first line and ends after the close on the last
+		size_t get_begin() const
+		{return m_begin;}
+
+		size_t get_end() const
+		{return m_end;}
+
+		void set_begin(size_t begin)
+		{m_begin = begin;}
+
+		void set_end(size_t end)
+		{m_end = end;}
+
+		// only a piece of the line, the rest is on the next block_line
+		bool continues() const
+		{return m_is_cont;}
+
+		void set_continues(bool is_cont)
+		{m_is_cont = is_cont;}
+
 	private:
-		std::string m_line;
+		const char * m_line;
+		size_t m_len;
 		size_t m_line_no;
+		size_t m_begin;
+		size_t m_end;
 		uint32_t m_tok_mask;
+		bool m_is_cont;
+	};
+
+	// what happens to the lines of a block once its open is found
+	enum line_mode : uint32_t {
+		LM_STORE,  // every line is kept; the default
+		LM_STREAM, // finished lines go to the sink and are dropped
+		LM_SKIP    // only the current line is kept, only the nesting matters
+	};
+
+	// Sees the lines of a block while it's parsed. A line is finished when
+	// the parser moves past it.
+	class line_sink
+	{
+	public:
+		virtual ~line_sink() {}
+
+		// the open was found; head holds the lines from the name to the open
+		virtual line_mode block_start(const std::vector<block_line>& head) = 0;
+
+		// a finished line; not called in LM_SKIP
+		virtual line_mode block_line_done(const block_line& line) = 0;
+
+		// the last line of the block, nullptr on a nesting error
+		virtual void block_end(const block_line * last) = 0;
+	};
+
+	// sees every line of the last block in order, spilled ones included
+	class line_visitor
+	{
+	public:
+		virtual ~line_visitor() {}
+		virtual void visit(const block_line& line, bool is_last) = 0;
+	};
+
+	// where the last block is in the input, in bytes from its start
+	struct block_span
+	{
+		size_t name_byte;
+		size_t name_end_byte;  // just past the name
+		size_t open_byte;
+		size_t close_end_byte; // just past the close
+		size_t first_line;
+		size_t last_line;
+		size_t depth;          // of the deepest block inside, 0 for none
+	};
+
+	// where the name of a block has to start for it to be returned; the
+	// lines are from 1, the last one included
+	struct name_range
+	{
+		size_t first_byte;
+		size_t end_byte; // just past the range
+		size_t first_line;
+		size_t last_line;
 	};
 
 public:
 	block_parser(lexer& lex) :
+		m_span(),
+		m_resume_byte(0),
+		m_resume_line(1),
+		m_range{0, SIZE_MAX, 0, SIZE_MAX},
 		m_lexer(lex),
+		m_sink(nullptr),
 		m_fname(nullptr)
 	{}
 
 	void init(const char * fname);
 	bool parse_block();
 
+	void set_sink(line_sink * sink)
+	{m_sink = sink;}
+
+	// a block with its name before the range is parsed only for its nesting,
+	// one after it ends the input; a block may go on past the end
+	void set_range(const name_range& range)
+	{m_range = range;}
+
+	// above about this many bytes the stored lines of a block are written to
+	// a temporary file; 0 is no limit
+	void set_max_block_memory(size_t max_bytes)
+	{m_block.set_max_memory(max_bytes);}
+
+	void visit_block(line_visitor& vis)
+	{m_block.visit(vis);}
+
 	bool had_error()
 	{return m_error.had_error();}
 
 	const std::vector<block_line>& get_block()
 	{return m_block.get_content();}
 
+	// valid when the last block had no error
+	const block_span& get_span()
+	{return m_span;}
+
+	// the text of the name of the last block
+	const std::string& get_name()
+	{return m_name;}
+
 	const std::vector<std::string>& get_error_report()
 	{return m_error.get_text();}
 
+	// just past the close of the last block without an error, or where the
+	// input started; a later run can start there with a fresh parser
+	size_t get_resume_byte()
+	{return m_resume_byte;}
+
+	// the line that byte is on, from 1
+	size_t get_resume_line()
+	{return m_resume_line;}
+
 private:
+	// Bump allocator for the text of the block lines. Chunks are kept and
+	// reused for every block of every file, so once they've grown to fit the
+	// usual block saving a line doesn't allocate. reset() frees the chunks
+	// past the first few MB, so a huge block doesn't hold on to its memory.
+	class arena
+	{
+	public:
+		arena() :
+			m_curr(0),
+			m_used(0)
+		{}
+
+		const char * save(const char * txt, size_t len);
+
+		void reset();
+
+	private:
+		struct chunk
+		{
+			chunk(size_t sz) :
+				data(new char[sz]), size(sz)
+			{}
+
+			std::unique_ptr<char[]> data;
+			size_t size;
+		};
+
+		std::vector<chunk> m_chunks;
+		size_t m_curr;
+		size_t m_used;
+	};
+
 	class parsed_block
 	{
 	public:
 		parsed_block() :
-			m_last_saved_line_no(0)
+			m_sink(nullptr),
+			m_spill(nullptr),
+			m_spilled(0),
+			m_mem(0),
+			m_max_mem(0),
+			m_first_line_no(0),
+			m_last_saved_piece_no(0),
+			m_mode(LM_STORE),
+			m_is_started(false)
 		{}
 
-		void save_line(const char * txt, size_t line_num, lexer::tok token);
+		~parsed_block();
+
+		void save_line(
+			const char * txt,
+			size_t len,
+			size_t piece_num,
+			size_t line_num,
+			bool is_cont,
+			lexer::tok token
+		);
 		void reset();
+		void start(line_sink * sink);
+		void end(bool is_ok);
+		void visit(line_visitor& vis);
+
+		void set_max_memory(size_t max_bytes)
+		{m_max_mem = max_bytes;}
 
 		const std::vector<block_line>& get_content()
 		{return m_content;}
 
+		void set_begin(size_t begin)
+		{m_content.front().set_begin(begin);}
+
+		void set_end(size_t end)
+		{m_content.back().set_end(end);}
+
+		size_t get_first_line_no()
+		{return m_first_line_no;}
+
+	private:
+		struct p_spill_rec
+		{
+			size_t line_no;
+			size_t len;
+			size_t begin;
+			size_t end;
+			uint32_t tok_mask;
+			bool is_cont;
+		};
+
+		void p_line_done(const block_line& line);
+		void p_keep_last_only();
+		void p_spill();
+
 	private:
 		std::vector<block_line> m_content;
-		size_t m_last_saved_line_no;
+		arena m_text;
+		std::string m_spill_line;
+		line_sink * m_sink;
+		FILE * m_spill;
+		size_t m_spilled;
+		size_t m_mem;
+		size_t m_max_mem;
+		size_t m_first_line_no;
+		size_t m_last_saved_piece_no;
+		line_mode m_mode;
+		bool m_is_started;
 	};
 
 	class error
@@ -82,7 +307,8 @@ private:
 			const std::string& last_line_text,
 			const char * fname,
 			size_t lex_line_num,
-			size_t lex_line_pos
+			size_t lex_line_pos,
+			size_t lex_line_col
 		);
 		void reset();
 
@@ -97,7 +323,28 @@ private:
 		bool m_did_error_happen;
 	};
 
+	// keeps no line of a block out of the range
+	class skip_sink : public line_sink
+	{
+	public:
+		line_mode block_start(const std::vector<block_line>& head) override
+		{return LM_SKIP;}
+
+		line_mode block_line_done(const block_line& line) override
+		{return LM_SKIP;}
+
+		void block_end(const block_line * last) override
+		{}
+	};
+
+	enum range_pos : uint32_t {
+		R_BEFORE,
+		R_IN,
+		R_AFTER
+	};
+
 private:
+	range_pos p_range_pos();
 	bool p_find_block_name();
 	bool p_find_block_open();
 	bool p_find_open_or_close(lexer::tok * out_which);
@@ -111,7 +358,17 @@ private:
 	{m_block.reset();}
 
 	void p_save_line_unique(lexer::tok token)
-	{m_block.save_line(m_lexer.get_line().c_str(), m_lexer.line_num(), token);}
+	{
+		const std::string& line = m_lexer.get_line();
+		m_block.save_line(
+			line.c_str(),
+			line.length(),
+			m_lexer.piece_num(),
+			m_lexer.line_num(),
+			m_lexer.piece_continues(),
+			token
+		);
+	}
 
 protected:
 	bool o_find_block_name()
@@ -125,8 +382,15 @@ protected:
 
 private:
 	parsed_block m_block;
+	block_span m_span;
+	std::string m_name;
+	size_t m_resume_byte;
+	size_t m_resume_line;
+	name_range m_range;
+	skip_sink m_skip_sink;
 	error m_error;
 	lexer& m_lexer;
+	line_sink * m_sink;
 	const char * m_fname;
 };
 #endif
@@ -0,0 +1,179 @@
+#include "follow.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FOLLOW_BUFF_SIZE (64 * 1024)
+
+// a file which takes the name isn't seen by the watch of the old one
+#define FOLLOW_POLL_MS 1000
+
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF)
+
+static std::runtime_error follow_error(const std::string& fname)
+{
+	return std::runtime_error(
+		std::string(fname).append(": ").append(strerror(errno))
+	);
+}
+
+follow_buff::follow_buff(const char * fname) :
+	m_buff(new char[FOLLOW_BUFF_SIZE]),
+	m_fname(fname),
+	m_pos(0),
+	m_dev(0),
+	m_ino(0),
+	m_fd(-1),
+	m_notify(-1),
+	m_watch(-1),
+	m_is_new(false)
+{
+	struct stat st;
+	m_fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (m_fd < 0 || fstat(m_fd, &st) != 0)
+	{
+		int err = errno;
+		if (m_fd >= 0)
+			close(m_fd);
+		errno = err;
+		throw follow_error(m_fname);
+	}
+	m_dev = st.st_dev;
+	m_ino = st.st_ino;
+
+	m_notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_notify < 0)
+	{
+		int err = errno;
+		close(m_fd);
+		errno = err;
+		throw follow_error(m_fname);
+	}
+
+	if (!p_watch())
+	{
+		int err = errno;
+		close(m_notify);
+		close(m_fd);
+		errno = err;
+		throw follow_error(m_fname);
+	}
+}
+
+follow_buff::~follow_buff()
+{
+	close(m_notify);
+	close(m_fd);
+}
+
+follow_buff::int_type follow_buff::underflow()
+{
+	ssize_t got = 0;
+	while (true)
+	{
+		got = read(m_fd, m_buff.get(), FOLLOW_BUFF_SIZE);
+		if (got > 0)
+		{
+			m_pos += got;
+			setg(m_buff.get(), m_buff.get(), m_buff.get() + got);
+			return traits_type::to_int_type(*gptr());
+		}
+
+		if (got < 0 && EINTR != errno)
+			throw follow_error(m_fname);
+
+		if (got < 0)
+			continue;
+
+		switch (p_at_end())
+		{
+			case E_NEW_FILE:
+				return traits_type::eof();
+
+			case E_WAIT:
+				p_wait();
+			break;
+
+			default:
+			case E_MORE:
+			break;
+		}
+	}
+}
+
+follow_buff::p_end follow_buff::p_at_end()
+{
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+		throw follow_error(m_fname);
+
+	if (st.st_size < m_pos)
+	{
+		if (lseek(m_fd, 0, SEEK_SET) < 0)
+			throw follow_error(m_fname);
+		m_pos = 0;
+		m_is_new = true;
+		return E_NEW_FILE;
+	}
+
+	// the old file may have been written to after the last read
+	if (st.st_size > m_pos)
+		return E_MORE;
+
+	if (stat(m_fname.c_str(), &st) != 0
+		|| (st.st_dev == m_dev && st.st_ino == m_ino))
+	{
+		return E_WAIT;
+	}
+
+	int fd = open(m_fname.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		if (fd >= 0)
+			close(fd);
+		return E_WAIT;
+	}
+
+	close(m_fd);
+	m_fd = fd;
+	m_dev = st.st_dev;
+	m_ino = st.st_ino;
+	m_pos = 0;
+	m_is_new = true;
+
+	// without a watch it's still polled
+	p_watch();
+	return E_NEW_FILE;
+}
+
+bool follow_buff::p_watch()
+{
+	if (m_watch >= 0)
+		inotify_rm_watch(m_notify, m_watch);
+
+	m_watch = inotify_add_watch(m_notify, m_fname.c_str(), WATCH_EVENTS);
+	return (m_watch >= 0);
+}
+
+void follow_buff::p_wait()
+{
+	pollfd pfd;
+	pfd.fd = m_notify;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, FOLLOW_POLL_MS) < 0 && EINTR != errno)
+		throw follow_error(m_fname);
+
+	// only that something happened matters
+	char events[4096];
+	while (read(m_notify, events, sizeof(events)) > 0)
+		continue;
+}
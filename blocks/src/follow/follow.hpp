@@ -0,0 +1,58 @@
+#ifndef FOLLOW_HPP
+#define FOLLOW_HPP
+
+#include <streambuf>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include <sys/types.h>
+
+// Reads a file which is being appended to and never ends. At the end of the
+// file it waits for more with inotify, so whoever reads from it, e.g. the
+// lexer, keeps its state and goes on where it stopped. A truncated file is
+// read again from its start; when another file takes its name, e.g. after
+// rotation, what's left of the old one is read first and then the new one
+// from its start. Either way the reader sees an end first, so it can start
+// over, and next_file() is true.
+class follow_buff : public std::streambuf
+{
+public:
+	// throws std::runtime_error if fname can't be opened or watched
+	follow_buff(const char * fname);
+	~follow_buff();
+
+	// true once after the end which came before a new or truncated file
+	bool next_file()
+	{
+		bool ret = m_is_new;
+		m_is_new = false;
+		return ret;
+	}
+
+protected:
+	int_type underflow() override;
+
+private:
+	enum p_end : uint32_t {
+		E_WAIT,
+		E_MORE,
+		E_NEW_FILE
+	};
+
+	p_end p_at_end();
+	bool p_watch();
+	void p_wait();
+
+private:
+	std::unique_ptr<char[]> m_buff;
+	std::string m_fname;
+	off_t m_pos;
+	dev_t m_dev;
+	ino_t m_ino;
+	int m_fd;
+	int m_notify;
+	int m_watch;
+	bool m_is_new;
+};
+#endif
@@ -0,0 +1,331 @@
+#include "c_lexer.hpp"
+
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#define RAW_DELIM_MAX 16
+
+static const char comment_end[] = "*/";
+
+static inline bool is_ident_char(unsigned char ch)
+{
+	return (isalnum(ch) || '_' == ch);
+}
+
+static inline bool is_number_char(unsigned char ch)
+{
+	return (is_ident_char(ch) || '.' == ch);
+}
+
+static bool token_cmp(const lexer::token& a, const lexer::token& b)
+{
+	// names come first on the same position, same as the matcher precedence
+	return (a.pos < b.pos || (a.pos == b.pos && a.kinds < b.kinds));
+}
+
+c_lexer::c_lexer(std::istream& in, const matchers& pats) :
+	lexer(in, pats),
+	m_state(S_CODE),
+	m_directive(false)
+{
+	m_code.reserve(8);
+	m_braces.reserve(8);
+}
+
+void c_lexer::reset()
+{
+	m_raw_end.clear();
+	m_state = S_CODE;
+	m_directive = false;
+	lexer::reset();
+}
+
+void c_lexer::o_scan_line()
+{
+	m_code.clear();
+	m_braces.clear();
+
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+	bool continues = (m_is_cont || (end && '\\' == str[end-1]));
+
+	// a piece which doesn't start its line can't start a directive
+	if (S_CODE == m_state && !m_directive && 0 == line_col())
+	{
+		size_t first = 0;
+		while (first < end && isspace(static_cast<unsigned char>(str[first])))
+			++first;
+		m_directive = (first < end && '#' == str[first]);
+	}
+
+	size_t pos = 0;
+	size_t found = 0;
+	while (pos < end)
+	{
+		switch (m_state)
+		{
+			case S_CODE:
+				pos = p_scan_code(pos);
+			break;
+
+			case S_BLOCK_COMMENT:
+			{
+				found = m_line.find(comment_end, pos, sizeof(comment_end)-1);
+				if (std::string::npos == found)
+				{
+					pos = end;
+				}
+				else
+				{
+					m_state = S_CODE;
+					pos = found + sizeof(comment_end)-1;
+				}
+			} break;
+
+			case S_STRING:
+				pos = p_scan_quoted(pos, '"');
+			break;
+
+			case S_CHAR:
+				pos = p_scan_quoted(pos, '\'');
+			break;
+
+			case S_RAW_STRING:
+				pos = p_scan_raw_string(pos);
+			break;
+
+			default:
+			case S_LINE_COMMENT:
+				pos = end;
+			break;
+		}
+	}
+
+	// a backslash at the end of the line continues line comments, directives,
+	// and literals
+	if (!continues)
+	{
+		m_directive = false;
+		if (S_LINE_COMMENT == m_state
+			|| S_STRING == m_state
+			|| S_CHAR == m_state)
+		{
+			m_state = S_CODE;
+		}
+	}
+
+	p_find_names();
+
+	if (m_toks.empty())
+	{
+		m_toks.swap(m_braces);
+	}
+	else if (!m_braces.empty())
+	{
+		size_t names = m_toks.size();
+		m_toks.insert(m_toks.end(), m_braces.begin(), m_braces.end());
+		std::inplace_merge(
+			m_toks.begin(),
+			m_toks.begin() + names,
+			m_toks.end(),
+			token_cmp
+		);
+	}
+}
+
+size_t c_lexer::o_piece_end(const char * str, size_t len)
+{
+	// after a statement or a brace; names and two character tokens like
+	// comment markers never have these in them
+	for (size_t i = len; i > 0; --i)
+	{
+		if (';' == str[i-1] || '{' == str[i-1] || '}' == str[i-1])
+			return i;
+	}
+	return len;
+}
+
+size_t c_lexer::p_scan_code(size_t pos)
+{
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+	size_t start = pos;
+	size_t next = end;
+	char ch = '\0';
+
+	for (; pos < end; ++pos)
+	{
+		ch = str[pos];
+		if ('{' == ch || '}' == ch)
+		{
+			if (!m_directive)
+			{
+				m_braces.emplace_back(
+					pos,
+					1,
+					('{' == ch) ? tok::OPEN : tok::CLOSE
+				);
+			}
+		}
+		else if ('/' == ch && pos+1 < end && '/' == str[pos+1])
+		{
+			m_state = S_LINE_COMMENT;
+			next = end;
+			break;
+		}
+		else if ('/' == ch && pos+1 < end && '*' == str[pos+1])
+		{
+			m_state = S_BLOCK_COMMENT;
+			next = pos+2;
+			break;
+		}
+		else if ('"' == ch)
+		{
+			if (p_is_raw_string_prefix(pos))
+			{
+				next = p_start_raw_string(pos);
+			}
+			else
+			{
+				m_state = S_STRING;
+				next = pos+1;
+			}
+			break;
+		}
+		else if ('\'' == ch && !p_is_digit_separator(pos))
+		{
+			m_state = S_CHAR;
+			next = pos+1;
+			break;
+		}
+	}
+
+	if (!m_directive && pos > start)
+		m_code.emplace_back(start, pos);
+
+	return next;
+}
+
+size_t c_lexer::p_scan_quoted(size_t pos, char quote)
+{
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+
+	for (; pos < end; ++pos)
+	{
+		if ('\\' == str[pos])
+		{
+			// an escaped new line continues the literal
+			if (pos+1 == end)
+				return end;
+			++pos;
+		}
+		else if (quote == str[pos])
+		{
+			m_state = S_CODE;
+			return pos+1;
+		}
+	}
+
+	// unterminated; don't let it eat the rest of the file, unless the line
+	// goes on in the next piece
+	if (!m_is_cont)
+		m_state = S_CODE;
+	return end;
+}
+
+size_t c_lexer::p_scan_raw_string(size_t pos)
+{
+	size_t found = m_line.find(m_raw_end, pos);
+	if (std::string::npos == found)
+		return m_line.length();
+
+	m_state = S_CODE;
+	return found + m_raw_end.length();
+}
+
+size_t c_lexer::p_start_raw_string(size_t pos)
+{
+	// R"delim( ... )delim"
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+	size_t delim = pos+1;
+	size_t i = delim;
+	char ch = '\0';
+
+	for (; i < end && (i - delim) <= RAW_DELIM_MAX; ++i)
+	{
+		ch = str[i];
+		if ('(' == ch)
+		{
+			m_raw_end.assign(")").append(str + delim, i - delim).append("\"");
+			m_state = S_RAW_STRING;
+			return i+1;
+		}
+		else if (')' == ch || '\\' == ch || '"' == ch
+			|| isspace(static_cast<unsigned char>(ch)))
+		{
+			break;
+		}
+	}
+
+	// not a valid raw string delimiter; treat as an ordinary string
+	m_state = S_STRING;
+	return pos+1;
+}
+
+bool c_lexer::p_is_raw_string_prefix(size_t pos) const
+{
+	static const char * prefixes[] = {"R", "u8R", "uR", "UR", "LR"};
+
+	const char * str = m_line.c_str();
+	size_t start = pos;
+	while (start > 0 && is_ident_char(str[start-1]))
+		--start;
+
+	size_t len = pos - start;
+	for (size_t i = 0; i < sizeof(prefixes)/sizeof(*prefixes); ++i)
+	{
+		if (strlen(prefixes[i]) == len
+			&& 0 == strncmp(str + start, prefixes[i], len))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+bool c_lexer::p_is_digit_separator(size_t pos) const
+{
+	// 1'000'000 in C++14 and C23
+	const char * str = m_line.c_str();
+	size_t start = pos;
+	while (start > 0 && is_number_char(str[start-1]))
+		--start;
+
+	return (start < pos && isdigit(static_cast<unsigned char>(str[start])));
+}
+
+void c_lexer::p_find_names()
+{
+	matcher * m = const_cast<matcher *>(m_pats.name);
+	if (!m)
+		return;
+
+	const char * str = m_line.c_str();
+	size_t pos = 0;
+	size_t len = 0;
+
+	for (const auto& code : m_code)
+	{
+		size_t start = code.start;
+		while (m->match(str, code.end, start))
+		{
+			pos = m->position();
+			len = m->length();
+			m_toks.emplace_back(pos, len, tok::NAME);
+			start = pos + (len ? len : 1);
+		}
+	}
+}
@@ -0,0 +1,59 @@
+#ifndef C_LEXER_HPP
+#define C_LEXER_HPP
+
+#include "lexer.hpp"
+
+#include <string>
+
+// Scans C and C++ in a single state machine instead of with the comment and
+// string matchers. Line and block comments, string and char literals, raw
+// strings, line continuations, and preprocessor directives produce no tokens.
+// '{' and '}' are the block open and close, the name matcher is matched only
+// against code.
+class c_lexer : public lexer
+{
+public:
+	c_lexer(std::istream& in, const matchers& pats);
+
+	void reset() override;
+
+protected:
+	void o_scan_line() override;
+	size_t o_piece_end(const char * str, size_t len) override;
+
+private:
+	enum p_state : uint32_t {
+		S_CODE,
+		S_LINE_COMMENT,
+		S_BLOCK_COMMENT,
+		S_STRING,
+		S_CHAR,
+		S_RAW_STRING
+	};
+
+	struct p_range
+	{
+		p_range(size_t s, size_t e) :
+			start(s), end(e)
+		{}
+
+		size_t start;
+		size_t end;
+	};
+
+	size_t p_scan_code(size_t pos);
+	size_t p_scan_quoted(size_t pos, char quote);
+	size_t p_scan_raw_string(size_t pos);
+	size_t p_start_raw_string(size_t pos);
+	bool p_is_raw_string_prefix(size_t pos) const;
+	bool p_is_digit_separator(size_t pos) const;
+	void p_find_names();
+
+private:
+	std::vector<p_range> m_code;
+	std::vector<token> m_braces;
+	std::string m_raw_end;
+	p_state m_state;
+	bool m_directive;
+};
+#endif
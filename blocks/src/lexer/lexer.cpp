@@ -1,120 +1,412 @@
 #include "lexer.hpp"
 
-#include <limits>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
 
-#define left_of(a, b) (a < b)
+bool lexer::next_line()
+{
+	bool was_cont = m_is_cont;
+	size_t prev_len = m_line.length();
+
+	if ((m_has_input = o_read_line()))
+	{
+		if (was_cont)
+		{
+			m_line_col += prev_len;
+		}
+		else
+		{
+			++m_line_no;
+			m_line_col = 0;
+		}
+
+		if (m_piece_no)
+			m_piece_byte += prev_len + !was_cont;
+
+		++m_piece_no;
+		m_line_pos = 0;
+		m_probe_end = 0;
+		m_last_match_len = 0;
+		m_toks.clear();
+		m_tok_curr = 0;
+
+		if (!m_in_line_comment)
+			o_scan_line();
+
+		// a line comment goes on in the next pieces of its line
+		m_in_line_comment = m_is_cont && (m_in_line_comment
+			|| (!m_toks.empty() && (m_toks.back().kinds & I_COMMENT)));
+	}
+	return m_has_input;
+}
 
-bool lexer::p_match(matcher * m, const char * text, size_t len, size_t start)
+bool lexer::o_get_piece(std::string& out, bool& is_cont)
 {
-	ptrdiff_t pos = 0;
-	while (m->match(text, len, start))
+	is_cont = false;
+	if (!m_piece_max)
+		return static_cast<bool>(std::getline(m_in, out));
+
+	std::streambuf * buf = m_in.rdbuf();
+	bool had_carry = !m_carry.empty();
+	int ch = EOF;
+
+	// always read m_piece_max more, so every byte is looked at about twice
+	out.swap(m_carry);
+	m_carry.clear();
+	size_t want = out.length() + m_piece_max;
+
+	while (out.length() < want)
 	{
-		if (!m_pats.string_rx)
-			return true;
+		if (EOF == (ch = buf->sbumpc()) || '\n' == ch)
+		{
+			m_cut_in_str = false;
+			return (EOF != ch || had_carry || !out.empty());
+		}
+		out.push_back(static_cast<char>(ch));
+	}
+
+	// full; the line goes on unless it ends right here
+	if ('\n' == (ch = buf->sgetc()) || EOF == ch)
+	{
+		if (EOF != ch)
+			buf->sbumpc();
+		m_cut_in_str = false;
+		return true;
+	}
+
+	is_cont = true;
+	size_t len = out.length();
+	size_t cut = o_piece_end(out.data(), len);
+	if (cut < len)
+	{
+		m_carry.assign(out, cut, std::string::npos);
+		out.resize(cut);
+	}
+
+	return true;
+}
 
-		pos = m->position();
-		if (!m_str_find.is_in_string(pos))
+size_t lexer::o_piece_end(const char * str, size_t len)
+{
+	// after the last space or punctuation outside of a double quoted string,
+	// so neither a word nor a string is cut in two
+	static const char punct[] = ",;:{}[]()<>";
+
+	bool quotes = m_pats.string_rx;
+	bool in_str = m_cut_in_str;
+	size_t cut = 0;
+	unsigned char ch = '\0';
+
+	for (size_t i = 0; i < len; ++i)
+	{
+		ch = str[i];
+		if (in_str)
+		{
+			if ('\\' == ch)
+				++i;
+			else if ('"' == ch)
+				in_str = false;
+		}
+		else if ('"' == ch && quotes)
+		{
+			in_str = true;
+		}
+		else if (isspace(ch) || (ch && strchr(punct, ch)))
+		{
+			cut = i+1;
+		}
+	}
+
+	// a string too long for the piece is cut anywhere
+	if (!cut)
+	{
+		m_cut_in_str = in_str;
+		return len;
+	}
+
+	m_cut_in_str = false;
+	return cut;
+}
+
+bool lexer::also_matches_open()
+{
+	const token * toks = m_toks.data();
+	for (size_t i = m_tok_curr, end = m_toks.size(); i < end; ++i)
+	{
+		if (toks[i].pos > m_line_pos)
+			break;
+		else if (toks[i].pos == m_line_pos && (toks[i].kinds & tok::OPEN))
 			return true;
+	}
+
+	size_t len = 0;
+	return ((m_anchored & tok::OPEN) && m_line_pos && m_line_pos < m_probe_end
+		&& p_match_at(m_pats.open, m_line_pos, &len));
+}
+
+lexer::tok lexer::p_next_token_of(uint32_t kinds)
+{
+	if (!m_has_input)
+		return tok::EOI;
+
+	const token * toks = m_toks.data();
+	size_t end = m_toks.size();
+
+	// the line position only moves forward
+	while (m_tok_curr < end && toks[m_tok_curr].pos < m_line_pos)
+		++m_tok_curr;
+
+	// the line was scanned from its start; the parser being past that is
+	// only seen by the anchored regexes
+	tok at = tok::NONE;
+	if ((m_anchored & kinds) && m_line_pos && m_line_pos < m_probe_end
+		&& tok::NONE != (at = p_anchored_at(kinds)))
+	{
+		return at;
+	}
+
+	uint32_t hit = 0;
+	for (size_t i = m_tok_curr; i < end; ++i)
+	{
+		const token& tk = toks[i];
+		if (tk.kinds & p_internal_tok::I_SKIP)
+		{
+			m_line_pos = tk.pos + tk.len;
+			continue;
+		}
+		else if (tk.kinds & p_internal_tok::I_COMMENT)
+		{
+			m_line_pos = tk.pos;
+			m_last_match_len = tk.len;
+			return tok::NONE;
+		}
+		else if ((hit = (tk.kinds & kinds)))
+		{
+			m_line_pos = tk.pos;
+			m_last_match_len = tk.len;
 
-		start = pos + m->length();
+			// same precedence as the order of the matchers
+			if (hit & tok::NAME)
+				return tok::NAME;
+			else if (hit & tok::OPEN)
+				return tok::OPEN;
+			return tok::CLOSE;
+		}
 	}
-	return false;
+
+	return tok::NONE;
 }
 
-lexer::p_internal_tok lexer::p_match_leftmost_of(
-	const i_tok_match * tms,
-	size_t len
-)
+lexer::tok lexer::p_anchored_at(uint32_t kinds)
 {
-	lexer::p_internal_tok match_tok = lexer::p_internal_tok::I_EOI;
+	static const tok order[] = {tok::NAME, tok::OPEN, tok::CLOSE};
+
+	const token * toks = m_toks.data();
+	size_t end = m_toks.size();
 
-	if (m_has_input)
+	// a comment which starts here comes first
+	if (m_tok_curr < end && toks[m_tok_curr].pos == m_line_pos
+		&& (toks[m_tok_curr].kinds & (I_SKIP | I_COMMENT)))
 	{
-		match_tok = lexer::p_internal_tok::I_NONE;
-		ptrdiff_t match_pos = 0;
-		ptrdiff_t last_pos = std::numeric_limits<ptrdiff_t>::max();
+		return tok::NONE;
+	}
+
+	const matcher * ms[] = {m_pats.name, m_pats.open, m_pats.close};
+	size_t len = 0;
 
-		const i_tok_match * ptm = nullptr;
-		matcher * m = nullptr;
-		const char * pline = m_line.c_str();
-		size_t llen = m_line.length();
-		for (size_t i = 0; i < len; ++i)
+	for (size_t k = 0; k < sizeof(order)/sizeof(*order); ++k)
+	{
+		if (!(order[k] & kinds))
+			continue;
+
+		for (size_t i = m_tok_curr; i < end && toks[i].pos == m_line_pos; ++i)
 		{
-			ptm = tms+i;
-			if ((m = const_cast<matcher *>(ptm->m)))
+			if (toks[i].kinds & order[k])
 			{
-				if (p_match(m, pline, llen, m_line_pos))
-				{
-					match_pos = m->position();
-					if (left_of(match_pos, last_pos))
-					{
-						last_pos = match_pos;
-						match_tok = ptm->t;
-						m_last_match_len = m->length();
-					}
-				}
+				m_last_match_len = toks[i].len;
+				return order[k];
 			}
 		}
 
-		if (match_tok != lexer::p_internal_tok::I_NONE)
-			m_line_pos = last_pos;
+		if ((m_anchored & order[k]) && p_match_at(ms[k], m_line_pos, &len))
+		{
+			m_last_match_len = len;
+			return order[k];
+		}
 	}
 
-	return match_tok;
+	return tok::NONE;
 }
 
-lexer::p_internal_tok lexer::p_leftmost_non_comment_intl(
-	const i_tok_match * tm,
-	size_t len
-)
+bool lexer::p_match_at(const matcher * m, size_t pos, size_t * out_len)
 {
-	lexer::p_internal_tok ret = lexer::p_internal_tok::I_NONE;
+	matcher * mt = const_cast<matcher *>(m);
+	if (!mt->match(m_line.c_str(), m_line.length(), pos)
+		|| static_cast<size_t>(mt->position()) != pos
+		|| (m_pats.string_rx && m_str_find.is_in_string(pos)))
+	{
+		return false;
+	}
+
+	*out_len = mt->length();
+	return true;
+}
 
-	if (!m_block_comment)
+uint32_t lexer::p_anchored_kinds(const matchers& pats)
+{
+	// '^', '\b' and '\B' see where a search starts as the start of the text
+	const matcher * ms[] = {pats.name, pats.open, pats.close};
+	const tok kinds[] = {tok::NAME, tok::OPEN, tok::CLOSE};
+	uint32_t ret = 0;
+
+	for (size_t i = 0; i < sizeof(ms)/sizeof(*ms); ++i)
 	{
-		ret = p_match_leftmost_of(tm, len);
-		if (lexer::p_internal_tok::I_COMMENT_START == ret)
+		if (ms[i] && 0 == strcmp(ms[i]->type_of(), "regex")
+			&& (strchr(ms[i]->pattern(), '^')
+				|| strstr(ms[i]->pattern(), "\\b")
+				|| strstr(ms[i]->pattern(), "\\B")))
 		{
-			m_block_comment = true;
-			advance_past_match();
-			ret = p_leftmost_non_comment_intl(tm, len);
+			ret |= kinds[i];
 		}
 	}
-	else
+
+	return ret;
+}
+
+void lexer::p_head_init(p_head& head, const matcher * m)
+{
+	head.m = const_cast<matcher *>(m);
+	head.pos = 0;
+	head.len = 0;
+	head.done = !m;
+
+	if (!head.done)
+		p_head_next(head, 0);
+}
+
+void lexer::p_head_next(p_head& head, size_t from)
+{
+	const char * str = m_line.c_str();
+	size_t len = m_line.length();
+	size_t pos = 0;
+
+	while (head.m->match(str, len, from))
 	{
-		ret = p_match_leftmost_of(m_comment_end.data(), m_comment_end.size());
-		if (lexer::p_internal_tok::I_COMMENT_END == ret)
+		pos = head.m->position();
+		if (!m_pats.string_rx || !m_str_find.is_in_string(pos))
 		{
-			m_block_comment = false;
-			advance_past_match();
-			ret = p_leftmost_non_comment_intl(tm, len);
+			head.pos = pos;
+			head.len = head.m->length();
+			return;
 		}
+		from = pos + (head.m->length() ? head.m->length() : 1);
 	}
 
-	return ret;
+	head.done = true;
 }
 
-bool lexer::also_matches_open()
+lexer::p_head * lexer::p_leftmost_head(p_head * heads, size_t resume)
 {
-	matcher * open = const_cast<matcher *>(m_pats.open);
+	// heads are in order of precedence for matches on the same position
+	p_head * ret = nullptr;
+	p_head * head = nullptr;
 
-	return (open
-		&& p_match(open, m_line.c_str(), m_line.length(), m_line_pos)
-		&& (open->position() == static_cast<ptrdiff_t>(m_line_pos)));
+	for (size_t i = H_COMMENT; i < H_COMMENT_END; ++i)
+	{
+		head = heads+i;
+		if (!head->done && head->pos < resume)
+			p_head_next(*head, resume);
+
+		if (!head->done && (!ret || head->pos < ret->pos))
+			ret = head;
+	}
+
+	return ret;
 }
 
-bool lexer::next_line()
+void lexer::o_scan_line()
 {
-	if ((m_has_input = static_cast<bool>(std::getline(m_in, m_line))))
+	static const uint32_t head_tok[H_TOTAL] = {
+		p_internal_tok::I_COMMENT,
+		0,
+		tok::NAME,
+		tok::OPEN,
+		tok::CLOSE,
+		0
+	};
+
+	if (m_pats.string_rx)
+		m_str_find.find_strings(m_line.c_str(), m_line.length());
+
+	m_probe_end = m_line.length();
+
+	p_head heads[H_TOTAL];
+	p_head_init(heads[H_COMMENT],       m_pats.comment);
+	p_head_init(heads[H_COMMENT_START], m_pats.comment_start);
+	p_head_init(heads[H_NAME],          m_pats.name);
+	p_head_init(heads[H_OPEN],          m_pats.open);
+	p_head_init(heads[H_CLOSE],         m_pats.close);
+	p_head_init(heads[H_COMMENT_END],   m_pats.comment_end);
+
+	// everything before resume belongs to a block comment
+	size_t resume = 0;
+	size_t skip_start = 0;
+	p_head * head = nullptr;
+
+	while (true)
 	{
-		++m_line_no;
-		m_line_pos = 0;
-		m_last_match_len = 0;
+		if (m_block_comment)
+		{
+			head = heads + H_COMMENT_END;
+			if (!head->done && head->pos < resume)
+				p_head_next(*head, resume);
+
+			if (head->done)
+			{
+				// no end on this line; only the comment start is walked past
+				m_probe_end = std::min(m_probe_end, skip_start);
+				if (resume > skip_start)
+					m_toks.emplace_back(skip_start, resume - skip_start, I_SKIP);
+				break;
+			}
 
-		if (m_pats.string_rx)
-			m_str_find.find_strings(m_line.c_str(), m_line.length());
+			m_block_comment = false;
+			resume = head->pos + head->len;
+			m_toks.emplace_back(skip_start, resume - skip_start, I_SKIP);
+			continue;
+		}
+
+		if (!(head = p_leftmost_head(heads, resume)))
+			break;
+
+		switch (head - heads)
+		{
+			case H_COMMENT:
+			{
+				// nothing after a line comment counts
+				m_probe_end = head->pos;
+				m_toks.emplace_back(head->pos, head->len, I_COMMENT);
+				goto done;
+			} break;
+
+			case H_COMMENT_START:
+			{
+				m_block_comment = true;
+				skip_start = head->pos;
+				resume = head->pos + head->len;
+			} break;
+
+			default:
+			{
+				m_toks.emplace_back(head->pos, head->len, head_tok[head - heads]);
+				p_head_next(*head, head->pos + (head->len ? head->len : 1));
+			} break;
+		}
 	}
-	return m_has_input;
+
+done:
+	return;
 }
 
 void lexer::string_finder::find_strings(const char * str, size_t len)
@@ -135,10 +427,19 @@ void lexer::string_finder::find_strings(const char * str, size_t len)
 
 bool lexer::string_finder::is_in_string(size_t pos) const
 {
-	for (const auto& r : m_ranges)
+	// the ranges are sorted and don't overlap
+	size_t lo = 0;
+	size_t hi = m_ranges.size();
+	size_t mid = 0;
+
+	while (lo < hi)
 	{
-		if (pos >= r.start && pos < r.end)
-			return true;
+		mid = lo + (hi - lo) / 2;
+		if (m_ranges[mid].end <= pos)
+			lo = mid+1;
+		else
+			hi = mid;
 	}
-	return false;
+
+	return (lo < m_ranges.size() && pos >= m_ranges[lo].start);
 }
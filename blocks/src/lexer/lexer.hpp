@@ -48,64 +48,100 @@ public:
 		const regex_matcher * string_rx;
 	};
 
+	// a token found when the line is scanned; kinds is a mask of tok values
+	// since e.g. the same text can be a name and an open
+	struct token
+	{
+		token(size_t p, size_t l, uint32_t k) :
+			pos(p), len(l), kinds(k)
+		{}
+
+		size_t pos;
+		size_t len;
+		uint32_t kinds;
+	};
+
 public:
 	lexer(std::istream& in, const matchers& pats) :
-		m_pats(pats),
 		m_str_find(pats.string_rx),
+		m_pats(pats),
 		m_in(in),
+		m_tok_curr(0),
 		m_line_pos(0),
+		m_probe_end(0),
 		m_line_no(0),
 		m_last_match_len(0),
 		m_has_input(false),
-		m_block_comment(false)
+		m_is_cont(false),
+		m_piece_max(0),
+		m_piece_no(0),
+		m_line_col(0),
+		m_piece_byte(0),
+		m_start_line(0),
+		m_start_byte(0),
+		m_block_comment(false),
+		m_in_line_comment(false),
+		m_cut_in_str(false),
+		m_anchored(p_anchored_kinds(pats))
 	{
-		m_name[0] = {m_pats.comment,       I_COMMENT};
-		m_name[1] = {m_pats.comment_start, I_COMMENT_START};
-		m_name[2] = {m_pats.name,          I_NAME};
-
-		m_name_open_close[0] = {m_pats.comment,       I_COMMENT};
-		m_name_open_close[1] = {m_pats.comment_start, I_COMMENT_START};
-		m_name_open_close[2] = {m_pats.name,          I_NAME};
-		m_name_open_close[3] = {m_pats.open,          I_OPEN};
-		m_name_open_close[4] = {m_pats.close,         I_CLOSE};
-
-		m_open_close[0] = {m_pats.comment,       I_COMMENT};
-		m_open_close[1] = {m_pats.comment_start, I_COMMENT_START};
-		m_open_close[2] = {m_pats.open,          I_OPEN};
-		m_open_close[3] = {m_pats.close,         I_CLOSE};
-
-		m_comment_end[0] = {m_pats.comment_end, I_COMMENT_END};
+		m_toks.reserve(16);
 	}
 
+	virtual ~lexer() {}
+
+	// each line is scanned once when it's read; these only walk the tokens
 	inline tok block_name()
-	{
-		return p_leftmost_non_comment(m_name.data(), m_name.size());
-	}
+	{return p_next_token_of(tok::NAME);}
 
 	inline tok block_name_open_close()
-	{
-		return p_leftmost_non_comment(
-			m_name_open_close.data(),
-			m_name_open_close.size()
-		);
-	}
+	{return p_next_token_of(tok::NAME | tok::OPEN | tok::CLOSE);}
 
 	inline tok block_open_close()
-	{
-		return p_leftmost_non_comment(m_open_close.data(), m_open_close.size());
-	}
+	{return p_next_token_of(tok::OPEN | tok::CLOSE);}
 
 	bool next_line();
 	bool also_matches_open();
 
-	void reset()
+	// Read lines in pieces of about max_bytes instead of whole, 0 is whole
+	// lines. A piece which doesn't end its line is cut where no token can be
+	// split, see o_piece_end(), unless there's no such place in it.
+	void set_piece_max(size_t max_bytes)
+	{m_piece_max = max_bytes;}
+
+	// the input starts this many lines and bytes into a file, e.g. after a
+	// seek; the first line read is the rest of line line_no+1; takes effect
+	// on reset()
+	void set_start(size_t line_no, size_t byte)
+	{
+		m_start_line = line_no;
+		m_start_byte = byte;
+	}
+
+	size_t start_line()
+	{return m_start_line;}
+
+	size_t start_byte()
+	{return m_start_byte;}
+
+	virtual void reset()
 	{
 		m_in.clear();
 		m_line.clear();
-		m_line_no = 0;
+		m_carry.clear();
+		m_line_no = m_start_line;
 		m_line_pos = 0;
+		m_probe_end = 0;
 		m_last_match_len = 0;
 		m_has_input = false;
+		m_is_cont = false;
+		m_piece_no = 0;
+		m_line_col = 0;
+		m_piece_byte = m_start_byte;
+		m_block_comment = false;
+		m_in_line_comment = false;
+		m_cut_in_str = false;
+		m_toks.clear();
+		m_tok_curr = 0;
 		next_line();
 	}
 
@@ -118,6 +154,10 @@ public:
 	inline const std::string& get_line()
 	{return m_line;}
 
+	// the length of the token last found at line_pos()
+	inline size_t match_len()
+	{return m_last_match_len;}
+
 	inline bool has_input()
 	{return m_has_input;}
 
@@ -127,25 +167,64 @@ public:
 	inline size_t line_pos()
 	{return m_line_pos;}
 
+	// the same as line_num() when lines are read whole
+	inline size_t piece_num()
+	{return m_piece_no;}
+
+	// the line goes on in the next piece
+	inline bool piece_continues()
+	{return m_is_cont;}
+
+	// line_pos() from the start of the line rather than of the piece
+	inline size_t line_col()
+	{return m_line_col + m_line_pos;}
+
+	// line_pos() from the start of the input; lines end in a single '\n'
+	inline size_t byte_pos()
+	{return m_piece_byte + m_line_pos;}
+
 private:
+	// token kinds which are never reported
 	enum p_internal_tok : uint32_t {
-		I_NAME,
-		I_OPEN,
-		I_CLOSE,
-		I_EOI,
-		I_COMMENT,
-		I_COMMENT_START,
-		I_COMMENT_END,
-		I_NONE
+		I_COMMENT = 0x08, // the rest of the line is a comment
+		I_SKIP    = 0x10, // a block comment, the walk jumps past it
+	};
+
+	enum p_head_kind : uint32_t {
+		H_COMMENT,
+		H_COMMENT_START,
+		H_NAME,
+		H_OPEN,
+		H_CLOSE,
+		H_COMMENT_END,
+		H_TOTAL
 	};
 
-	struct i_tok_match
+	// the next match of a matcher on the current line
+	struct p_head
 	{
-		const matcher * m;
-		p_internal_tok t;
+		matcher * m;
+		size_t pos;
+		size_t len;
+		bool done;
 	};
 
 protected:
+	// read the next line, or piece of a line, into m_line
+	virtual bool o_read_line()
+	{return o_get_piece(m_line, m_is_cont);}
+
+	// Where a piece of len bytes which doesn't end its line can be cut; the
+	// rest goes to the next piece. len if there's no such place.
+	virtual size_t o_piece_end(const char * str, size_t len);
+
+	// a whole line, or a piece of one if set_piece_max() was called
+	bool o_get_piece(std::string& out, bool& is_cont);
+
+	// fill m_toks for m_line in order of position; comments and strings have
+	// to be resolved by the time this returns
+	virtual void o_scan_line();
+
 	class string_finder
 	{
 	public:
@@ -158,7 +237,6 @@ protected:
 		void find_strings(const char * str, size_t len);
 		bool is_in_string(size_t pos) const;
 
-	std::array<i_tok_match, 1> m_comment_end;
 		inline const auto& o_test_get_ranges() const
 		{
 			return m_ranges;
@@ -179,40 +257,45 @@ protected:
 	};
 
 private:
-	bool p_match(matcher * m, const char * text, size_t len, size_t start);
-	p_internal_tok p_match_leftmost_of(const i_tok_match * tm, size_t len);
-	p_internal_tok p_leftmost_non_comment_intl(
-		const i_tok_match * tm,
-		size_t len
-	);
-
-	inline tok p_leftmost_non_comment(const i_tok_match * tm, size_t len)
-	{
-		tok ret = tok::NONE;
-		switch(p_leftmost_non_comment_intl(tm, len))
-		{
-			case p_internal_tok::I_NAME:  ret = tok::NAME;  break;
-			case p_internal_tok::I_OPEN:  ret = tok::OPEN;  break;
-			case p_internal_tok::I_CLOSE: ret = tok::CLOSE; break;
-			case p_internal_tok::I_EOI:   ret = tok::EOI;   break;
-			default:                      ret = tok::NONE;  break;
-		}
-		return ret;
-	}
+	tok p_next_token_of(uint32_t kinds);
+	tok p_anchored_at(uint32_t kinds);
+	bool p_match_at(const matcher * m, size_t pos, size_t * out_len);
+	static uint32_t p_anchored_kinds(const matchers& pats);
+	void p_head_init(p_head& head, const matcher * m);
+	void p_head_next(p_head& head, size_t from);
+	p_head * p_leftmost_head(p_head * heads, size_t resume);
 
 private:
-	matchers m_pats;
 	string_finder m_str_find;
-	std::array<i_tok_match, 5> m_name_open_close;
-	std::array<i_tok_match, 4> m_open_close;
-	std::array<i_tok_match, 3> m_name;
-	std::array<i_tok_match, 1> m_comment_end;
+
+protected:
+	matchers m_pats;
+	std::vector<token> m_toks;
 	std::string m_line;
 	std::istream& m_in;
+	size_t m_tok_curr;
 	size_t m_line_pos;
+	// where the parser is can be searched again up to here; set by
+	// o_scan_line() of this class only
+	size_t m_probe_end;
 	size_t m_line_no;
 	size_t m_last_match_len;
 	bool m_has_input;
+	bool m_is_cont;
+
+private:
+	std::string m_carry;
+	size_t m_piece_max;
+	size_t m_piece_no;
+	size_t m_line_col;
+	size_t m_piece_byte;
+	size_t m_start_line;
+	size_t m_start_byte;
 	bool m_block_comment;
+	bool m_in_line_comment;
+	bool m_cut_in_str;
+	// the kinds of the regexes which can match where the parser is without
+	// matching where the line was scanned, e.g. '^name'
+	uint32_t m_anchored;
 };
 #endif
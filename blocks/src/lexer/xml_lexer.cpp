@@ -0,0 +1,359 @@
+#include "xml_lexer.hpp"
+
+#include <cstring>
+#include <cctype>
+
+#define STR_LEN(str) (sizeof(str)-1)
+
+// how far past its line the end of a start tag is looked for, a byte for each
+// line end; a tag not ended by then is an open
+#define MAX_TAG_LOOKAHEAD (64*1024)
+
+static const char comment_begin[] = "<!--";
+static const char comment_end[] = "-->";
+static const char cdata_begin[] = "<![CDATA[";
+static const char cdata_end[] = "]]>";
+static const char pi_begin[] = "<?";
+static const char pi_end[] = "?>";
+static const char decl_begin[] = "<!";
+static const char end_tag_begin[] = "</";
+
+const char * const xml_lexer::any_tag_rx = "^([_:a-zA-Z][-._:a-zA-Z0-9]*)$";
+
+static inline bool is_name_start(unsigned char ch)
+{
+	return (isalpha(ch) || '_' == ch || ':' == ch || ch > 0x7F);
+}
+
+static inline bool is_name_char(unsigned char ch)
+{
+	return (is_name_start(ch) || isdigit(ch) || '-' == ch || '.' == ch);
+}
+
+static inline bool is_quote(char ch)
+{
+	return ('"' == ch || '\'' == ch);
+}
+
+static inline bool starts_with(
+	const std::string& str,
+	size_t pos,
+	const char * what,
+	size_t what_len
+)
+{
+	return (0 == str.compare(pos, what_len, what));
+}
+
+xml_lexer::xml_lexer(std::istream& in, const matchers& pats) :
+	lexer(in, pats),
+	m_decl_depth(0),
+	m_state(S_TEXT),
+	m_quote('\0'),
+	m_any_tag(!pats.name || 0 == strcmp(pats.name->pattern(), any_tag_rx))
+{}
+
+void xml_lexer::reset()
+{
+	m_ahead.clear();
+	m_decl_depth = 0;
+	m_state = S_TEXT;
+	m_quote = '\0';
+	lexer::reset();
+}
+
+bool xml_lexer::o_read_line()
+{
+	if (m_ahead.empty())
+		return o_get_piece(m_line, m_is_cont);
+
+	m_line.swap(m_ahead.front().text);
+	m_is_cont = m_ahead.front().is_cont;
+	m_ahead.pop_front();
+	return true;
+}
+
+size_t xml_lexer::o_piece_end(const char * str, size_t len)
+{
+	// after the end or before the start of some markup, so tag names and
+	// comment or CDATA markers are never cut in two
+	for (size_t i = len-1; i > 0; --i)
+	{
+		if ('>' == str[i-1] || '<' == str[i])
+			return i;
+	}
+	return len;
+}
+
+bool xml_lexer::p_peek_line(size_t n, const std::string ** out)
+{
+	p_piece piece;
+	while (m_ahead.size() <= n)
+	{
+		if (!o_get_piece(piece.text, piece.is_cont))
+			return false;
+		m_ahead.push_back(std::move(piece));
+	}
+
+	*out = &(m_ahead[n].text);
+	return true;
+}
+
+void xml_lexer::o_scan_line()
+{
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+	size_t pos = 0;
+
+	while (pos < end)
+	{
+		switch (m_state)
+		{
+			case S_TEXT:
+			{
+				const void * lt = memchr(str+pos, '<', end-pos);
+				pos = lt ? p_scan_markup(static_cast<const char *>(lt) - str)
+					: end;
+			} break;
+
+			case S_TAG:
+				pos = p_scan_tag(pos);
+			break;
+
+			case S_COMMENT:
+				pos = p_skip_past(comment_end, STR_LEN(comment_end), pos);
+			break;
+
+			case S_CDATA:
+				pos = p_skip_past(cdata_end, STR_LEN(cdata_end), pos);
+			break;
+
+			case S_PI:
+				pos = p_skip_past(pi_end, STR_LEN(pi_end), pos);
+			break;
+
+			case S_DECL:
+				pos = p_scan_decl(pos);
+			break;
+
+			default:
+				pos = end;
+			break;
+		}
+	}
+}
+
+size_t xml_lexer::p_scan_markup(size_t pos)
+{
+	if (starts_with(m_line, pos, comment_begin, STR_LEN(comment_begin)))
+	{
+		m_state = S_COMMENT;
+		return pos + STR_LEN(comment_begin);
+	}
+	else if (starts_with(m_line, pos, cdata_begin, STR_LEN(cdata_begin)))
+	{
+		m_state = S_CDATA;
+		return pos + STR_LEN(cdata_begin);
+	}
+	else if (starts_with(m_line, pos, pi_begin, STR_LEN(pi_begin)))
+	{
+		m_state = S_PI;
+		return pos + STR_LEN(pi_begin);
+	}
+	else if (starts_with(m_line, pos, decl_begin, STR_LEN(decl_begin)))
+	{
+		m_state = S_DECL;
+		m_decl_depth = 0;
+		return pos + STR_LEN(decl_begin);
+	}
+	else if (starts_with(m_line, pos, end_tag_begin, STR_LEN(end_tag_begin)))
+	{
+		size_t name = pos + STR_LEN(end_tag_begin);
+		size_t len = p_tag_name_len(name);
+
+		// a lone '<' is text
+		if (!len)
+			return pos+1;
+
+		// the close takes in the '>' when it's on the same line, so the
+		// block ends after it
+		if (p_is_wanted_tag(name, len))
+			m_toks.emplace_back(pos, p_end_tag_len(pos, name + len), tok::CLOSE);
+
+		m_state = S_TAG;
+		return name + len;
+	}
+
+	size_t name = pos+1;
+	size_t len = p_tag_name_len(name);
+
+	if (!len)
+		return pos+1;
+
+	if (p_is_wanted_tag(name, len) && !p_is_self_closing(name + len))
+		m_toks.emplace_back(pos, len+1, (tok::NAME | tok::OPEN));
+
+	m_state = S_TAG;
+	return name + len;
+}
+
+size_t xml_lexer::p_scan_tag(size_t pos)
+{
+	const char * str = m_line.c_str();
+	char ch = '\0';
+
+	for (size_t end = m_line.length(); pos < end; ++pos)
+	{
+		ch = str[pos];
+		if (m_quote)
+		{
+			if (ch == m_quote)
+				m_quote = '\0';
+		}
+		else if (is_quote(ch))
+		{
+			m_quote = ch;
+		}
+		else if ('>' == ch)
+		{
+			m_state = S_TEXT;
+			return pos+1;
+		}
+		else if ('<' == ch)
+		{
+			// the tag was never closed; be lenient and let '<' start the next
+			// markup
+			m_state = S_TEXT;
+			return pos;
+		}
+	}
+
+	return pos;
+}
+
+size_t xml_lexer::p_scan_decl(size_t pos)
+{
+	const char * str = m_line.c_str();
+	char ch = '\0';
+
+	for (size_t end = m_line.length(); pos < end; ++pos)
+	{
+		ch = str[pos];
+		if (m_quote)
+		{
+			if (ch == m_quote)
+				m_quote = '\0';
+		}
+		else if (is_quote(ch))
+		{
+			m_quote = ch;
+		}
+		else if ('[' == ch)
+		{
+			++m_decl_depth;
+		}
+		else if (']' == ch)
+		{
+			if (m_decl_depth)
+				--m_decl_depth;
+		}
+		else if ('>' == ch && !m_decl_depth)
+		{
+			m_state = S_TEXT;
+			return pos+1;
+		}
+	}
+
+	return pos;
+}
+
+size_t xml_lexer::p_skip_past(const char * term, size_t term_len, size_t pos)
+{
+	size_t found = m_line.find(term, pos, term_len);
+	if (std::string::npos == found)
+		return m_line.length();
+
+	m_state = S_TEXT;
+	return found + term_len;
+}
+
+size_t xml_lexer::p_tag_name_len(size_t pos) const
+{
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+
+	if (pos >= end || !is_name_start(str[pos]))
+		return 0;
+
+	size_t i = pos+1;
+	while (i < end && is_name_char(str[i]))
+		++i;
+
+	return i - pos;
+}
+
+size_t xml_lexer::p_end_tag_len(size_t pos, size_t name_end) const
+{
+	const char * str = m_line.c_str();
+	size_t end = m_line.length();
+	size_t i = name_end;
+
+	while (i < end && isspace(static_cast<unsigned char>(str[i])))
+		++i;
+
+	return ((i < end && '>' == str[i]) ? i+1 : name_end) - pos;
+}
+
+bool xml_lexer::p_is_wanted_tag(size_t pos, size_t len)
+{
+	if (m_any_tag)
+		return true;
+
+	matcher * m = const_cast<matcher *>(m_pats.name);
+	return (m->match(m_line.c_str(), pos + len, pos)
+		&& static_cast<size_t>(m->position()) == pos
+		&& m->length() == len);
+}
+
+bool xml_lexer::p_is_self_closing(size_t pos)
+{
+	// look for the end of the start tag, possibly on the following lines
+	const std::string * line = &m_line;
+	const char * str = nullptr;
+	size_t ahead = 0;
+	char quote = '\0';
+	char ch = '\0';
+
+	for (size_t n = 0; ahead <= MAX_TAG_LOOKAHEAD; ++n)
+	{
+		str = line->c_str();
+		for (size_t i = pos, end = line->length(); i < end; ++i)
+		{
+			ch = str[i];
+			if (quote)
+			{
+				if (ch == quote)
+					quote = '\0';
+			}
+			else if (is_quote(ch))
+			{
+				quote = ch;
+			}
+			else if ('>' == ch)
+			{
+				return (i > 0 && '/' == str[i-1]);
+			}
+			else if ('<' == ch)
+			{
+				return false;
+			}
+		}
+
+		if (!p_peek_line(n, &line))
+			break;
+		ahead += line->length()+1;
+		pos = 0;
+	}
+
+	return false;
+}
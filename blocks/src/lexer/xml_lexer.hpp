@@ -0,0 +1,64 @@
+#ifndef XML_LEXER_HPP
+#define XML_LEXER_HPP
+
+#include "lexer.hpp"
+
+#include <string>
+#include <deque>
+
+// Scans xml by hand in a single forward pass instead of with the block
+// matchers. Start tags are both a name and an open, end tags are a close.
+// Self-closing tags, comments, CDATA sections, processing instructions,
+// declarations, and quoted attribute values produce no tokens. Only the name
+// matcher is used and it has to match the whole tag name. The end of a start
+// tag is looked for only so far past its line; a tag not ended by then is an
+// open.
+class xml_lexer : public lexer
+{
+public:
+	// a block name with this pattern matches any tag
+	static const char * const any_tag_rx;
+
+	xml_lexer(std::istream& in, const matchers& pats);
+
+	void reset() override;
+
+protected:
+	bool o_read_line() override;
+	void o_scan_line() override;
+	size_t o_piece_end(const char * str, size_t len) override;
+
+private:
+	struct p_piece
+	{
+		std::string text;
+		bool is_cont;
+	};
+
+	enum p_state : uint32_t {
+		S_TEXT,
+		S_TAG,
+		S_COMMENT,
+		S_CDATA,
+		S_PI,
+		S_DECL
+	};
+
+	size_t p_scan_markup(size_t pos);
+	size_t p_scan_tag(size_t pos);
+	size_t p_scan_decl(size_t pos);
+	size_t p_skip_past(const char * term, size_t term_len, size_t pos);
+	size_t p_tag_name_len(size_t pos) const;
+	size_t p_end_tag_len(size_t pos, size_t name_end) const;
+	bool p_is_wanted_tag(size_t pos, size_t len);
+	bool p_is_self_closing(size_t pos);
+	bool p_peek_line(size_t n, const std::string ** out);
+
+private:
+	std::deque<p_piece> m_ahead;
+	size_t m_decl_depth;
+	p_state m_state;
+	char m_quote;
+	bool m_any_tag;
+};
+#endif
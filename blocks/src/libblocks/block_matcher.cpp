@@ -0,0 +1,127 @@
+#include "block_matcher.hpp"
+
+block_matcher::block_matcher(
+	const matchers * match,
+	const matchers * dont_match,
+	bool and_mM_together,
+	bool sub_line,
+	bool keep_lines
+) :
+	m_match(match),
+	m_dont_match(dont_match),
+	m_match_left(0),
+	m_and_mM_together(and_mM_together),
+	m_sub_line(sub_line),
+	m_keep_lines(keep_lines),
+	m_store(true),
+	m_was_dont_match(false),
+	m_is_decided(false)
+{
+	if (m_match)
+		m_was_match.resize(m_match->size());
+}
+
+bool block_matcher::is_match()
+{
+	bool all_matched = (0 == m_match_left);
+	bool all_didnt_match = !m_was_dont_match;
+
+	if (m_match && m_dont_match)
+	{
+		return m_and_mM_together
+			? (all_matched && all_didnt_match)
+			: (all_matched || all_didnt_match);
+	}
+	else if (m_match)
+	{
+		return all_matched;
+	}
+	else if (m_dont_match)
+	{
+		return all_didnt_match;
+	}
+
+	return false;
+}
+
+block_parser::line_mode block_matcher::block_start(
+	const std::vector<block_parser::block_line>& head
+)
+{
+	m_was_match.assign(m_was_match.size(), false);
+	m_match_left = m_was_match.size();
+	m_was_dont_match = false;
+	m_is_decided = false;
+	return (m_store || m_keep_lines)
+		? block_parser::LM_STORE : block_parser::LM_STREAM;
+}
+
+block_parser::line_mode block_matcher::block_line_done(
+	const block_parser::block_line& line
+)
+{
+	if (!m_is_decided)
+		p_match_line(line);
+
+	if (m_keep_lines)
+		return block_parser::LM_STORE;
+
+	if (m_is_decided && (!is_match() || !m_store))
+		return block_parser::LM_SKIP;
+
+	return m_store ? block_parser::LM_STORE : block_parser::LM_STREAM;
+}
+
+void block_matcher::block_end(const block_parser::block_line * last)
+{
+	if (last && !m_is_decided)
+		p_match_line(*last);
+}
+
+void block_matcher::p_match_line(const block_parser::block_line& line)
+{
+	const char * str = line.get_line();
+	size_t len = line.get_line_len();
+	matcher * pm = nullptr;
+
+	if (m_sub_line)
+	{
+		str += line.get_begin();
+		len = line.get_end() - line.get_begin();
+	}
+
+	if (m_match)
+	{
+		const std::unique_ptr<matcher> * data = m_match->data();
+		for (size_t i = 0, end = m_match->size(); i < end; ++i)
+		{
+			pm = data[i].get();
+			if (!m_was_match[i] && pm && pm->match(str, len, 0))
+			{
+				m_was_match[i] = true;
+				--m_match_left;
+			}
+		}
+	}
+
+	if (m_dont_match && !m_was_dont_match)
+	{
+		const std::unique_ptr<matcher> * data = m_dont_match->data();
+		for (size_t i = 0, end = m_dont_match->size(); i < end; ++i)
+		{
+			pm = data[i].get();
+			if (pm && pm->match(str, len, 0))
+			{
+				m_was_dont_match = true;
+				break;
+			}
+		}
+	}
+
+	bool is_and = (!m_match || m_and_mM_together);
+	bool is_rejected = (m_dont_match && m_was_dont_match && is_and);
+	bool is_accepted = (m_match && 0 == m_match_left
+		&& (!m_dont_match || !m_and_mM_together));
+
+	m_is_decided = (is_rejected || is_accepted);
+}
@@ -0,0 +1,62 @@
+#ifndef BLOCK_MATCHER_HPP
+#define BLOCK_MATCHER_HPP
+
+#include "block_parser.hpp"
+#include "matcher.hpp"
+
+#include <vector>
+#include <memory>
+
+// Matches -m and -M one line at a time while the block is parsed. Once the
+// block surely doesn't match the parser only tracks its nesting, and once the
+// outcome can't change no more lines are matched.
+class block_matcher : public block_parser::line_sink
+{
+public:
+	typedef std::vector<std::unique_ptr<matcher>> matchers;
+
+	// either can be nullptr for none; with both a block has to pass both when
+	// and_mM_together, either one otherwise; with sub_line only what gets
+	// printed of a line is matched; keep_lines stores a block which won't
+	// match, e.g. to print it on a nesting error
+	block_matcher(
+		const matchers * match,
+		const matchers * dont_match,
+		bool and_mM_together,
+		bool sub_line = false,
+		bool keep_lines = false
+	);
+
+	bool is_match();
+
+	// false when nothing will read the lines of a block which matches; they
+	// are then only matched as they're parsed and never stored
+	void set_store(bool store)
+	{m_store = store;}
+
+	block_parser::line_mode block_start(
+		const std::vector<block_parser::block_line>& head
+	) override;
+
+	block_parser::line_mode block_line_done(
+		const block_parser::block_line& line
+	) override;
+
+	void block_end(const block_parser::block_line * last) override;
+
+private:
+	void p_match_line(const block_parser::block_line& line);
+
+private:
+	const matchers * m_match;
+	const matchers * m_dont_match;
+	std::vector<bool> m_was_match;
+	size_t m_match_left;
+	bool m_and_mM_together;
+	bool m_sub_line;
+	bool m_keep_lines;
+	bool m_store;
+	bool m_was_dont_match;
+	bool m_is_decided;
+};
+#endif
@@ -0,0 +1,221 @@
+#include "libblocks.hpp"
+#include "xml_lexer.hpp"
+#include "c_lexer.hpp"
+#include "matcher_factory.hpp"
+
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#define FD_BUFF_SIZE (64 * 1024)
+
+// reads a buffer in place
+class mem_buff : public std::streambuf
+{
+public:
+	mem_buff(const char * data, size_t size)
+	{
+		char * begin = const_cast<char *>(data);
+		setg(begin, begin, begin + size);
+	}
+};
+
+// reads a file descriptor without taking it over
+class fd_buff : public std::streambuf
+{
+public:
+	fd_buff(int fd) :
+		m_buff(new char[FD_BUFF_SIZE]),
+		m_fd(fd)
+	{}
+
+protected:
+	int_type underflow() override
+	{
+		ssize_t got = 0;
+		do
+			got = read(m_fd, m_buff.get(), FD_BUFF_SIZE);
+		while (got < 0 && EINTR == errno);
+
+		if (got < 0)
+			throw std::runtime_error(strerror(errno));
+
+		if (0 == got)
+			return traits_type::eof();
+
+		setg(m_buff.get(), m_buff.get(), m_buff.get() + got);
+		return traits_type::to_int_type(*gptr());
+	}
+
+private:
+	std::unique_ptr<char[]> m_buff;
+	int m_fd;
+};
+
+matcher * blocks_make_matcher(
+	const char * pat,
+	bool is_regex,
+	bool is_icase
+)
+{
+	if (!pat || !*pat)
+		return nullptr;
+
+	matcher_factory mfact;
+	return mfact.create(
+		is_regex ? matcher::type::REGEX : matcher::type::STRING,
+		pat,
+		is_icase ? matcher::flags::ICASE : matcher::flags::NONE
+	);
+}
+
+lexer * blocks_make_lexer(
+	blocks_config::scanner scan,
+	std::istream& in,
+	const lexer::matchers& pats
+)
+{
+	if (blocks_config::SCAN_XML == scan)
+		return new xml_lexer(in, pats);
+	else if (blocks_config::SCAN_C == scan)
+		return new c_lexer(in, pats);
+
+	return new lexer(in, pats);
+}
+
+static matcher * make_pattern(const blocks_pattern& pat)
+{
+	return blocks_make_matcher(pat.pat.c_str(), pat.is_regex, pat.is_icase);
+}
+
+blocks_finder::blocks_finder(const blocks_config& cfg) :
+	m_in(nullptr)
+{
+	const blocks_pattern * scalars[] = {
+		&cfg.name,
+		&cfg.open,
+		&cfg.close,
+		&cfg.comment,
+		&cfg.comment_begin,
+		&cfg.comment_term
+	};
+
+	for (const blocks_pattern * pat : scalars)
+		m_pats.emplace_back(make_pattern(*pat));
+
+	m_pats.emplace_back(blocks_make_matcher(
+		cfg.string_rx.pat.c_str(),
+		true,
+		cfg.string_rx.is_icase
+	));
+
+	if (!m_pats[1] || !m_pats[2])
+		throw std::runtime_error("block start and block end cannot be empty");
+
+	for (const auto& pat : cfg.match)
+		m_match.emplace_back(make_pattern(pat));
+
+	for (const auto& pat : cfg.dont_match)
+		m_dont_match.emplace_back(make_pattern(pat));
+
+	lexer::matchers lex_matchers(
+		m_pats[0].get(),
+		m_pats[1].get(),
+		m_pats[2].get(),
+		m_pats[3].get(),
+		m_pats[4].get(),
+		m_pats[5].get(),
+		static_cast<const regex_matcher *>(m_pats[6].get())
+	);
+
+	m_lexer.reset(blocks_make_lexer(cfg.scan, m_in, lex_matchers));
+	m_lexer->set_piece_max(cfg.sub_line);
+	m_parser.reset(new block_parser(*m_lexer));
+	m_parser->set_max_block_memory(cfg.max_block_memory);
+
+	if (!m_match.empty() || !m_dont_match.empty())
+	{
+		m_bmatch.reset(new block_matcher(
+			m_match.empty() ? nullptr : &m_match,
+			m_dont_match.empty() ? nullptr : &m_dont_match,
+			cfg.and_mM_together,
+			cfg.sub_line
+		));
+		m_parser->set_sink(m_bmatch.get());
+	}
+}
+
+bool blocks_finder::find(
+	const char * data,
+	size_t size,
+	const char * name,
+	const callback& cb
+)
+{
+	mem_buff buff(data, size);
+	return p_find(&buff, name, cb);
+}
+
+bool blocks_finder::find(const char * path, const callback& cb)
+{
+	std::filebuf buff;
+	if (!buff.open(path, std::ios_base::in | std::ios_base::binary))
+	{
+		throw std::runtime_error(
+			std::string(path).append(": ").append(strerror(errno))
+		);
+	}
+	return p_find(&buff, path, cb);
+}
+
+bool blocks_finder::find(int fd, const char * name, const callback& cb)
+{
+	fd_buff buff(fd);
+	return p_find(&buff, name, cb);
+}
+
+bool blocks_finder::find(
+	std::istream& in,
+	const char * name,
+	const callback& cb
+)
+{
+	return p_find(in.rdbuf(), name, cb);
+}
+
+bool blocks_finder::p_find(
+	std::streambuf * buf,
+	const char * name,
+	const callback& cb
+)
+{
+	// a read error gets out of the lexer instead of looking like the end
+	m_errors.clear();
+	m_in.rdbuf(buf);
+	m_in.clear();
+	m_in.exceptions(std::ios_base::badbit);
+
+	block_parser& parser = *m_parser;
+	bool is_ok = true;
+
+	parser.init(name);
+	while (parser.parse_block())
+	{
+		if (parser.had_error())
+		{
+			is_ok = false;
+			const std::vector<std::string>& report = parser.get_error_report();
+			m_errors.insert(m_errors.end(), report.begin(), report.end());
+		}
+		else if (!m_bmatch || m_bmatch->is_match())
+		{
+			if (!cb(blocks_view(name, parser)))
+				break;
+		}
+	}
+
+	return is_ok;
+}
@@ -0,0 +1,146 @@
+#ifndef LIBBLOCKS_HPP
+#define LIBBLOCKS_HPP
+
+#include "block_parser.hpp"
+#include "block_matcher.hpp"
+#include "lexer.hpp"
+#include "matcher.hpp"
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <functional>
+#include <iostream>
+
+// Finds blocks without the command line. A lexer and the -m/-M predicates are
+// made from a blocks_config, and every block from a buffer, a file, or a file
+// descriptor which passes goes to a callback as a view. Nothing is printed;
+// nesting errors are kept as their report.
+
+struct blocks_pattern
+{
+	blocks_pattern(const char * p = "", bool regex = false, bool icase = false)
+		: pat(p), is_regex(regex), is_icase(icase)
+	{}
+
+	std::string pat; // empty is none
+	bool is_regex;
+	bool is_icase;
+};
+
+struct blocks_config
+{
+	// what scans the input; the xml scanner uses only the name, which has to
+	// match the whole tag name
+	enum scanner : uint32_t {
+		SCAN_MATCHERS,
+		SCAN_C,
+		SCAN_XML
+	};
+
+	// a '{' '}' block named by its open, no comments or strings
+	blocks_config() :
+		name("{"),
+		open("{"),
+		close("}"),
+		and_mM_together(true),
+		scan(SCAN_MATCHERS),
+		sub_line(0),
+		max_block_memory(0)
+	{}
+
+	blocks_pattern name;
+	blocks_pattern open;
+	blocks_pattern close;
+	blocks_pattern comment;
+	blocks_pattern comment_begin;
+	blocks_pattern comment_term;
+	blocks_pattern string_rx; // always a regex
+
+	// a block has to have every match and no dont_match, or with
+	// and_mM_together false either one; without either every block passes
+	std::vector<blocks_pattern> match;
+	std::vector<blocks_pattern> dont_match;
+	bool and_mM_together;
+
+	scanner scan;
+	size_t sub_line;         // the same as --sub-line, 0 is off
+	size_t max_block_memory; // the same as --max-block-memory, 0 is no limit
+};
+
+// a block which passed; valid only during the callback
+class blocks_view
+{
+public:
+	blocks_view(const char * name, block_parser& parser) :
+		m_name(name),
+		m_parser(parser)
+	{}
+
+	// of the input
+	const char * name() const
+	{return m_name;}
+
+	// where the block is, its lines numbered from 1 and its bytes from the
+	// start of the input, from its name to just past its close
+	const block_parser::block_span& span() const
+	{return m_parser.get_span();}
+
+	// every line of the block in order, spilled ones included
+	void visit(block_parser::line_visitor& vis) const
+	{m_parser.visit_block(vis);}
+
+private:
+	const char * m_name;
+	block_parser& m_parser;
+};
+
+class blocks_finder
+{
+public:
+	// false stops reading the input
+	typedef std::function<bool (const blocks_view&)> callback;
+
+	// throws std::runtime_error for a bad pattern
+	explicit blocks_finder(const blocks_config& cfg);
+
+	// all return false if the input had a nesting error; throw
+	// std::runtime_error if the input can't be read
+	bool find(const char * data, size_t size, const char * name,
+		const callback& cb);
+	bool find(const char * path, const callback& cb);
+	bool find(int fd, const char * name, const callback& cb);
+	bool find(std::istream& in, const char * name, const callback& cb);
+
+	// the report of every nesting error in the last input
+	const std::vector<std::string>& get_error_report() const
+	{return m_errors;}
+
+private:
+	bool p_find(std::streambuf * buf, const char * name, const callback& cb);
+
+private:
+	std::vector<std::unique_ptr<matcher>> m_pats;
+	block_matcher::matchers m_match;
+	block_matcher::matchers m_dont_match;
+	std::vector<std::string> m_errors;
+	std::istream m_in;
+	std::unique_ptr<lexer> m_lexer;
+	std::unique_ptr<block_parser> m_parser;
+	std::unique_ptr<block_matcher> m_bmatch;
+};
+
+// nullptr for an empty pattern; throws std::runtime_error for a bad one
+matcher * blocks_make_matcher(
+	const char * pat,
+	bool is_regex,
+	bool is_icase
+);
+
+lexer * blocks_make_lexer(
+	blocks_config::scanner scan,
+	std::istream& in,
+	const lexer::matchers& pats
+);
+
+#endif
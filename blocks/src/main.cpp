@@ -1,23 +1,36 @@
-#include "block_parser.hpp"
+#include "libblocks.hpp"
+#include "xml_lexer.hpp"
 #include "matcher.hpp"
 #include "find_files.hpp"
+#include "block_index.hpp"
+#include "serve.hpp"
+#include "follow.hpp"
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include <cstring>
+#include <cctype>
 #include <cstdlib>
 #include <cerrno>
 #include <filesystem>
+#include <cinttypes>
+
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define BLOCKS_EXIT_HAD_MATCH EXIT_SUCCESS
 #define BLOCKS_EXIT_NO_MATCH  1
 #define BLOCKS_EXIT_HAD_ERROR 2
 
 static const char * program_name = "blocks";
-static const char * program_version = "4.1";
+static const char * program_version = "4.2";
 
 static const char * str_stdin = "-";
 
@@ -49,6 +62,20 @@ enum elang {
 	LANG_END
 };
 
+enum eoutput {
+	OUTPUT_TEXT = 0,
+	OUTPUT_JSONL,
+	OUTPUT_OFFSETS,
+	OUTPUT_COUNT,
+	OUTPUT_GROUP
+};
+
+enum etop_by {
+	TOP_BY_NONE = 0,
+	TOP_BY_LINES,
+	TOP_BY_BYTES
+};
+
 struct mdata {
 	const char * pat;
 	bool is_regex;
@@ -94,7 +121,24 @@ struct prog_options {
 	const char * file_list;
 	const char * files_dir;
 	const char * lang_name;
+	const char * cache_dir;
+	const char * batch_file;
+	const char * label;
+	const char * state_file;
+	const char * serve_sock;
+	const char * client_sock;
+	// every --client argument, as it is in argv
+	std::vector<const char *> client_args;
 	elang which_lang;
+	eoutput output;
+	etop_by top_by;
+	size_t max_block_mem;
+	size_t top_k;
+	size_t sub_line;
+	size_t shard_index;
+	size_t shard_count;
+	size_t byte_range[2]; // [first, end)
+	size_t line_range[2]; // [first, last]
 	int block_count;
 	int skip_count;
 	bool line_numbers;
@@ -106,6 +150,14 @@ struct prog_options {
 	bool no_defaults;
 	bool fatal_error;
 	bool verbose_error;
+	bool check;
+	bool build_index;
+	bool index_trigrams;
+	bool follow;
+	bool with_body;
+	bool count_total;
+	bool has_byte_range;
+	bool has_line_range;
 	bool debug;
 	bool no_strings;
 	bool recursive;
@@ -116,6 +168,7 @@ struct prog_options {
 };
 
 struct process_result {
+	size_t count; // of the blocks taken
 	bool was_match;
 	bool was_err;
 };
@@ -172,6 +225,14 @@ static const char * line_num_str(size_t num)
 	return num_str;
 }
 
+// --count; a file without blocks gets its line too
+static void print_count(const char * fname, size_t count)
+{
+	static std::string out;
+	out.assign(fname).append(":").append(std::to_string(count));
+	print_line(out.c_str());
+}
+
 static void fatal_error_exit()
 {
 	std::string err("quitting due to --");
@@ -180,15 +241,21 @@ static void fatal_error_exit()
 	exit_err();
 }
 
-static void print_block_stderr(
-	const std::vector<block_parser::block_line>& block
-)
+// -V; the block may have spilled to disk
+class block_stderr_printer : public block_parser::line_visitor
 {
-	for (const auto& b_line : block)
+public:
+	void visit(const block_parser::block_line& line, bool is_last) override
 	{
-		print_str_stderr(line_num_str(b_line.get_line_no()));
-		print_line_stderr(b_line.get_line().c_str());
+		print_str_stderr(line_num_str(line.get_line_no()));
+		print_line_stderr(line.get_line());
 	}
+};
+
+static void print_block_stderr(block_parser& parser)
+{
+	block_stderr_printer printer;
+	parser.visit_block(printer);
 }
 
 static void print_error_report(const std::vector<std::string>& report)
@@ -197,58 +264,286 @@ static void print_error_report(const std::vector<std::string>& report)
 		print_err(str.c_str());
 }
 
-static void print_block(
+// a block is printed with its lines, or only where it is
+static bool prints_lines(const prog_options& opts)
+{
+	return (OUTPUT_TEXT == opts.output || opts.with_body);
+}
+
+// the lines of a block are kept while it's read; --top-k reads them back
+static bool stores_lines(const prog_options& opts)
+{
+	return (prints_lines(opts) && !opts.top_k);
+}
+
+// Appends a line of a block to be printed. With --sub-line only the bytes of
+// the block are, and a line in pieces is put back together.
+static void append_block_line(
+	std::string& out,
 	const prog_options& opts,
 	const char * fname,
-	const std::vector<block_parser::block_line>& block
+	const block_parser::block_line& line,
+	bool is_last,
+	bool * at_line_start
 )
 {
-	static std::string fname_on_match("");
+	if (*at_line_start)
+	{
+		if (opts.label)
+			out.append(opts.label).append(":");
+
+		if (opts.with_filename && fname)
+			out.append(fname).append(":");
+
+		if (opts.line_numbers)
+			out.append(line_num_str(line.get_line_no()));
+	}
+
+	if (!opts.sub_line)
+	{
+		out.append(line.get_line(), line.get_line_len()).append("\n");
+		return;
+	}
 
-	bool with_filename = opts.with_filename;
-	bool ignore_top = opts.ignore_top;
-	bool line_numbers = opts.line_numbers;
-	const char * mark_start = opts.mark_start;
-	const char * mark_end = opts.mark_end;
+	size_t begin = line.get_begin();
+	out.append(line.get_line() + begin, line.get_end() - begin);
 
-	if (with_filename && fname)
-		fname_on_match.assign(fname).append(":");
+	*at_line_start = (is_last || !line.continues());
+	if (*at_line_start)
+		out.append("\n");
+}
 
-	if (mark_start)
-		print_line(mark_start);
+// Appends str as the inside of a JSON string. The runs which need no escape
+// are appended whole, straight from str.
+static void append_json_str(std::string& out, const char * str, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
 
-	for (size_t i = 0, end = block.size(); i < end; ++i)
+	const char * run = str;
+	const char * end = str + len;
+	unsigned char ch = 0;
+	for (const char * pch = str; pch < end; ++pch)
 	{
-		if (ignore_top && (0 == i))
+		ch = static_cast<unsigned char>(*pch);
+		if (ch >= 0x20 && '"' != ch && '\\' != ch)
+			continue;
+
+		out.append(run, pch - run);
+		run = pch+1;
+		switch (ch)
 		{
-			size_t j = 0;
-			while (j < end)
-			{
-				if (block[j].has_token(lexer::tok::OPEN))
-					break;
-				++j;
-			}
+			case '"':  out.append("\\\""); break;
+			case '\\': out.append("\\\\"); break;
+			case '\n': out.append("\\n"); break;
+			case '\t': out.append("\\t"); break;
+			case '\r': out.append("\\r"); break;
+			default:
+				out.append("\\u00");
+				out.push_back(hex[ch >> 4]);
+				out.push_back(hex[ch & 0xf]);
+			break;
+		}
+	}
+	out.append(run, end - run);
+}
 
-			i = j;
-			continue;
+// Appends a line of a block to a --with-body; the same text as
+// append_block_line(), without the -N, -l, and --label prefixes.
+static void append_json_line(
+	std::string& out,
+	const prog_options& opts,
+	const block_parser::block_line& line,
+	bool is_last
+)
+{
+	if (!opts.sub_line)
+	{
+		append_json_str(out, line.get_line(), line.get_line_len());
+		out.append("\\n");
+		return;
+	}
+
+	size_t begin = line.get_begin();
+	append_json_str(out, line.get_line() + begin, line.get_end() - begin);
+	if (is_last || !line.continues())
+		out.append("\\n");
+}
+
+// A block from an index; the lines and the name are in the mapped file.
+struct index_block
+{
+	std::vector<block_parser::block_line> lines;
+	block_parser::block_span span;
+	const char * name;
+	size_t name_len;
+};
+
+// Prints a stored block, from memory or from where it spilled. With
+// --output=jsonl a block is an object on a line of its own.
+class block_printer : public block_parser::line_visitor
+{
+public:
+	block_printer(const prog_options& opts) :
+		m_opts(opts),
+		m_fname(nullptr),
+		m_in_top(false),
+		m_at_line_start(false)
+	{}
+
+	void print(block_parser& parser, const char * fname)
+	{
+		const std::string& name = parser.get_name();
+		p_begin(fname, parser.get_span(), name.data(), name.length());
+		if (prints_lines(m_opts))
+			parser.visit_block(*this);
+		p_end();
+	}
+
+	void print(const index_block& blk, const char * fname)
+	{
+		p_begin(fname, blk.span, blk.name, blk.name_len);
+		for (size_t i = 0, end = blk.lines.size(); prints_lines(m_opts)
+			&& i < end; ++i)
+		{
+			visit(blk.lines[i], (i == end-1));
 		}
+		p_end();
+	}
 
-		if (ignore_top && (i == (end-1)))
-			break;
+	// a block a line at a time, visit() in between
+	void begin(
+		const char * fname,
+		const block_parser::block_span& span,
+		const char * name,
+		size_t name_len
+	)
+	{p_begin(fname, span, name, name_len);}
+
+	void end()
+	{p_end();}
+
+	void visit(const block_parser::block_line& line, bool is_last) override
+	{
+		// -I skips all up to and including the open, and the last line
+		if (m_in_top)
+		{
+			if (line.has_token(lexer::tok::OPEN))
+				m_in_top = false;
+			return;
+		}
+
+		if (m_opts.ignore_top && is_last)
+			return;
+
+		m_out.clear();
+		if (OUTPUT_JSONL == m_opts.output)
+		{
+			append_json_line(m_out, m_opts, line, is_last);
+		}
+		else
+		{
+			append_block_line(m_out, m_opts, m_fname, line, is_last,
+				&m_at_line_start);
+		}
+		print_str(m_out.c_str());
+	}
+
+private:
+	void p_begin(
+		const char * fname,
+		const block_parser::block_span& span,
+		const char * name,
+		size_t name_len
+	)
+	{
+		m_fname = fname;
+		m_in_top = m_opts.ignore_top;
+		m_at_line_start = true;
+
+		if (OUTPUT_JSONL == m_opts.output)
+		{
+			p_json_begin(span, name, name_len);
+			return;
+		}
+		else if (OUTPUT_OFFSETS == m_opts.output)
+		{
+			p_offsets(span);
+			return;
+		}
 
-		if (with_filename)
-			print_str(fname_on_match.c_str());
+		if (m_opts.mark_start)
+			print_line(m_opts.mark_start);
+	}
 
-		if (line_numbers)
-			print_str(line_num_str(block[i].get_line_no()));
+	void p_end()
+	{
+		if (OUTPUT_JSONL == m_opts.output)
+			print_line(m_opts.with_body ? "\"}" : "}");
+		else if (OUTPUT_TEXT == m_opts.output && m_opts.mark_end)
+			print_line(m_opts.mark_end);
 
-		print_line(block[i].get_line().c_str());
+		std::cout.flush();
 	}
 
-	if (mark_end)
-		print_line(mark_end);
-}
+	// --offsets; the file name is as it is, the same as in the text output
+	void p_offsets(const block_parser::block_span& span)
+	{
+		m_out.clear();
+		if (m_opts.label)
+			m_out.append(m_opts.label).append(":");
+
+		m_out.append(m_fname ? m_fname : str_stdin).append("\t")
+			.append(std::to_string(span.name_byte)).append("\t")
+			.append(std::to_string(span.close_end_byte)).append("\t")
+			.append(std::to_string(span.first_line)).append("\t")
+			.append(std::to_string(span.last_line));
+		print_line(m_out.c_str());
+	}
 
+	// every member but the body, which is printed line by line after it
+	void p_json_begin(
+		const block_parser::block_span& span,
+		const char * name,
+		size_t name_len
+	)
+	{
+		const char * fname = m_fname ? m_fname : str_stdin;
+
+		m_out.assign("{");
+		if (m_opts.label)
+		{
+			m_out.append("\"label\":\"");
+			append_json_str(m_out, m_opts.label, strlen(m_opts.label));
+			m_out.append("\",");
+		}
+
+		m_out.append("\"file\":\"");
+		append_json_str(m_out, fname, strlen(fname));
+		m_out.append("\",\"name\":\"");
+		append_json_str(m_out, name, name_len);
+		m_out.append("\",\"first_line\":")
+			.append(std::to_string(span.first_line))
+			.append(",\"last_line\":")
+			.append(std::to_string(span.last_line))
+			.append(",\"start_byte\":")
+			.append(std::to_string(span.name_byte))
+			.append(",\"end_byte\":")
+			.append(std::to_string(span.close_end_byte))
+			.append(",\"depth\":")
+			.append(std::to_string(span.depth));
+
+		if (m_opts.with_body)
+			m_out.append(",\"body\":\"");
+		print_str(m_out.c_str());
+	}
+
+private:
+	std::string m_out;
+	const prog_options& m_opts;
+	const char * m_fname;
+	bool m_in_top;
+	bool m_at_line_start;
+};
 
 static void print_debug_a_matcher(const char * str, const matcher * mtchr)
 {
@@ -356,27 +651,166 @@ static void print_debug_and_quit(
 	exit(EXIT_SUCCESS);
 }
 
-static matcher * make_a_pattern(const mdata * data, matcher_factory& mfact)
+// <warm>
+// what queries on a server compiled and opened; the server keeps it, so the
+// queries after get it with their copy of the server, and a query takes what
+// it needs of its copy. Outside of a server it stays empty.
+#define WARM_MAX_MATCHERS 256
+#define WARM_MAX_INDEXES 256
+
+class warm_cache
 {
-	static const matcher::type mtypes[2] = {
-		matcher::type::STRING,
-		matcher::type::REGEX
-	};
+public:
+	// made new when not kept; the caller owns it either way
+	matcher * take_matcher(const mdata * data)
+	{
+		matcher_key(data, m_key);
 
-	static const uint32_t matcher_flags[2] = {
-		matcher::flags::NONE,
-		(matcher::flags::NONE | matcher::flags::ICASE)
-	};
+		auto it = m_matchers.find(m_key);
+		if (it != m_matchers.end() && it->second)
+			return it->second.release();
+
+		matcher * mtch = blocks_make_matcher(
+			data->pat,
+			data->is_regex,
+			data->is_icase
+		);
+		if (mtch)
+			serve_report(m_key.data(), m_key.size());
+		return mtch;
+	}
+
+	// the kept index of fname when it is still current, otherwise idx once
+	// it's opened; nullptr when fname has no good index
+	block_index * open_index(
+		block_index& idx,
+		const char * fname,
+		uint64_t config_hash,
+		const char * idx_name = nullptr
+	)
+	{
+		if (!index_key(fname, config_hash, idx_name, m_key))
+			return idx.open(fname, config_hash, idx_name) ? &idx : nullptr;
+
+		auto it = m_indexes.find(m_key);
+		if (it != m_indexes.end() && it->second->is_current(fname, idx_name))
+			return it->second.get();
+
+		if (!idx.open(fname, config_hash, idx_name))
+			return nullptr;
+
+		serve_report(m_key.data(), m_key.size());
+		return &idx;
+	}
+
+	// in the server, makes what a query reported
+	void warm(const char * rec, size_t len)
+	{
+		std::string key(rec, len);
+		try
+		{
+			if (key.size() > 3 && 'm' == key[0])
+				warm_matcher(key);
+			else if (key.size() > 17 && 'i' == key[0])
+				warm_index(key);
+		}
+		catch (const std::runtime_error&)
+		{
+			// a query which reported it has already told its client
+		}
+	}
+
+private:
+	static void matcher_key(const mdata * data, std::string& out)
+	{
+		out.assign("m");
+		out.push_back(data->is_regex ? '1' : '0');
+		out.push_back(data->is_icase ? '1' : '0');
+		out.append(data->pat ? data->pat : "");
+	}
+
+	// false for what can't be told apart by its name
+	static bool index_key(
+		const char * fname,
+		uint64_t config_hash,
+		const char * idx_name,
+		std::string& out
+	)
+	{
+		std::error_code ec;
+		std::filesystem::path fpath = std::filesystem::absolute(fname, ec);
+		if (ec)
+			return false;
+
+		std::filesystem::path ipath;
+		if (idx_name)
+		{
+			ipath = std::filesystem::absolute(idx_name, ec);
+			if (ec)
+				return false;
+		}
+
+		char hash[17];
+		snprintf(hash, sizeof(hash), "%016" PRIx64, config_hash);
+		out.assign("i").append(hash).append(fpath.string());
+		out.push_back('\0');
+		out.append(ipath.string());
+		return true;
+	}
+
+	void warm_matcher(const std::string& key)
+	{
+		mdata data = {key.c_str() + 3, '1' == key[1], '1' == key[2]};
+
+		auto it = m_matchers.find(key);
+		if (it == m_matchers.end() && m_matchers.size() >= WARM_MAX_MATCHERS)
+			m_matchers.clear();
+		m_matchers[key].reset(
+			blocks_make_matcher(data.pat, data.is_regex, data.is_icase)
+		);
+	}
+
+	void warm_index(const std::string& key)
+	{
+		uint64_t config_hash = strtoull(key.substr(1, 16).c_str(), nullptr, 16);
+		const char * fname = key.c_str() + 17;
+		const char * idx_name = fname + strlen(fname) + 1;
+		if (idx_name >= key.c_str() + key.size())
+			idx_name = nullptr;
+
+		std::unique_ptr<block_index> idx(new block_index());
+		if (!idx->open(fname, config_hash, idx_name))
+		{
+			m_indexes.erase(key);
+			return;
+		}
 
-	matcher * ret = nullptr;
-	const char * mpat = data->pat;
-	bool is_regex = data->is_regex;
-	bool is_icase = data->is_icase;
+		auto it = m_indexes.find(key);
+		if (it == m_indexes.end() && m_indexes.size() >= WARM_MAX_INDEXES)
+			m_indexes.clear();
+		m_indexes[key] = std::move(idx);
+	}
+
+	std::unordered_map<std::string, std::unique_ptr<matcher>> m_matchers;
+	std::unordered_map<std::string, std::unique_ptr<block_index>> m_indexes;
+	std::string m_key;
+};
+
+static warm_cache& get_warm_cache()
+{
+	static warm_cache cache;
+	return cache;
+}
 
-	if (mpat && *mpat)
-		 ret = mfact.create(mtypes[is_regex], mpat, matcher_flags[is_icase]);
+static void warm_from_query(const char * rec, size_t len)
+{
+	get_warm_cache().warm(rec, len);
+}
+// </warm>
 
-	return ret;
+static matcher * make_a_pattern(const mdata * data)
+{
+	return get_warm_cache().take_matcher(data);
 }
 
 static void make_patterns(const prog_options& opts, patterns& pats)
@@ -386,15 +820,14 @@ static void make_patterns(const prog_options& opts, patterns& pats)
 
 	try
 	{
-		matcher_factory mfact;
 		for (int i = M_FIRST; i < M_SCALAR_TOTAL; ++i)
-			matchers[i].reset(make_a_pattern(opts.matchers + i, mfact));
+			matchers[i].reset(make_a_pattern(opts.matchers + i));
 
 		for (const auto& data : opts.mM_vect.match)
-			pats.mM_vect.match.emplace_back(make_a_pattern(&data, mfact));
+			pats.mM_vect.match.emplace_back(make_a_pattern(&data));
 
 		for (const auto& data : opts.mM_vect.dont_match)
-			pats.mM_vect.dont_match.emplace_back(make_a_pattern(&data, mfact));
+			pats.mM_vect.dont_match.emplace_back(make_a_pattern(&data));
 
 		for (int i = M_FIRST; i < M_SCALAR_TOTAL; ++i)
 			pats.matchers[i] = matchers[i].get();
@@ -405,222 +838,1532 @@ static void make_patterns(const prog_options& opts, patterns& pats)
 	}
 }
 
-// <process>
-// <match>
-static bool match_in_block(
-	const matcher * pat,
-	const std::vector<block_parser::block_line>& block
+static lexer * make_lexer(
+	const prog_options& opts,
+	std::istream& in,
+	const lexer::matchers& lex_matchers
 )
 {
-	bool ret = false;
-	matcher * pm = const_cast<matcher *>(pat);
+	blocks_config::scanner scan = blocks_config::SCAN_MATCHERS;
+	if (LANG_XML == opts.which_lang)
+		scan = blocks_config::SCAN_XML;
+	else if (LANG_C == opts.which_lang)
+		scan = blocks_config::SCAN_C;
+
+	return blocks_make_lexer(scan, in, lex_matchers);
+}
+
+// <process>
+static bool process_a_block(prog_options& opts, block_matcher * bmatch)
+{
+	if (bmatch && !bmatch->is_match())
+		return false;
 
-	if (pm)
+	bool should_print = false;
+
+	if (0 == opts.skip_count)
 	{
-		const std::string * ps = nullptr;
-		for (const auto& line : block)
+		if (-1 == opts.block_count)
 		{
-			ps = &(line.get_line());
-			if (pm->match(ps->c_str(), ps->length(), 0))
-			{
-				ret = true;
-				break;
-			}
+			should_print = true;
 		}
+		else if (opts.block_count > 0)
+		{
+			should_print = true;
+			--opts.block_count;
+		}
+	}
+	else
+	{
+		--opts.skip_count;
 	}
 
-	return ret;
+	return should_print;
 }
 
-static bool all_matched(
-	const std::vector<std::unique_ptr<matcher>> * vect,
-	const std::vector<block_parser::block_line>& block
-)
+// --byte-range and --line-range; all of the input without them
+static block_parser::name_range name_range(const prog_options& opts)
 {
-	const std::unique_ptr<matcher> * data = vect->data();
-	for (size_t i = 0, end = vect->size(); i < end; ++i)
+	block_parser::name_range range = {0, SIZE_MAX, 0, SIZE_MAX};
+	if (opts.has_byte_range)
 	{
-		if (!match_in_block(data[i].get(), block))
-			return false;
+		range.first_byte = opts.byte_range[0];
+		range.end_byte = opts.byte_range[1];
 	}
 
-	return true;
+	if (opts.has_line_range)
+	{
+		range.first_line = opts.line_range[0];
+		range.last_line = opts.line_range[1];
+	}
+	return range;
 }
 
-static bool all_didnt_match(
-	const std::vector<std::unique_ptr<matcher>> * vect,
-	const std::vector<block_parser::block_line>& block
-)
+// <stream>
+// Prints a block while it's parsed when there's nothing to match in it, so the
+// whole block is never in memory. A block which is never printed, e.g. one
+// taken by -k, is only parsed for its nesting. Output is held back up to
+// STREAM_HOLD_MAX bytes; a block with a nesting error which fit is dropped,
+// same as a stored one. A bigger block has already been written in part, so
+// it gets flagged after the error report instead and its end mark is never
+// printed.
+#define STREAM_HOLD_MAX (64 * 1024)
+
+class block_streamer : public block_parser::line_sink
 {
-	const std::unique_ptr<matcher> * data = vect->data();
-	for (size_t i = 0, end = vect->size(); i < end; ++i)
+public:
+	block_streamer(const prog_options& opts) :
+		m_opts(opts),
+		m_fname(nullptr),
+		m_skip_lines(0),
+		m_lines_seen(0),
+		m_first_line_no(0),
+		m_is_on(false),
+		m_was_written(false),
+		m_is_partial(false),
+		m_at_line_start(false)
 	{
-		if (match_in_block(data[i].get(), block))
-			return false;
+		m_hold.reserve(STREAM_HOLD_MAX);
 	}
 
-	return true;
-}
+	void set_file(const char * fname)
+	{
+		m_fname = fname;
+		m_is_on = false;
+		m_is_partial = false;
+	}
 
-static bool match_a_block(
-	prog_options& opts,
-	const std::vector<std::unique_ptr<matcher>> * match,
-	const std::vector<std::unique_ptr<matcher>> * dont_match,
-	const std::vector<block_parser::block_line>& block
-)
-{
-	if (match && dont_match)
+	// the last block was printed by the streamer
+	bool was_streamed()
+	{return m_is_on;}
+
+	// the last block was in error after some of it was written; asking
+	// clears it
+	bool was_partial()
+	{
+		bool ret = m_is_partial;
+		m_is_partial = false;
+		return ret;
+	}
+
+	size_t first_line_no()
+	{return m_first_line_no;}
+
+	block_parser::line_mode block_start(
+		const std::vector<block_parser::block_line>& head
+	) override
 	{
-		if (opts.match_how.and_mM_together)
+		// -k and -c are decided when the block is done, same as when it's
+		// stored; only a block that will surely be printed is streamed. A
+		// jsonl object needs the end of its block first, and --offsets,
+		// --top-k, or a jsonl object without its body none of the lines.
+		m_is_on = false;
+		if (m_opts.skip_count > 0 || m_opts.check
+			|| m_opts.files_with_match || m_opts.files_without_match
+			|| !stores_lines(m_opts))
 		{
-			return (
-				all_matched(match, block)
-				&&
-				all_didnt_match(dont_match, block)
-			);
+			return block_parser::LM_SKIP;
 		}
-		else
+		else if (0 == m_opts.block_count || OUTPUT_TEXT != m_opts.output)
 		{
-			return (
-				all_matched(match, block)
-				||
-				all_didnt_match(dont_match, block)
-			);
+			return block_parser::LM_STORE;
+		}
+
+		m_is_on = true;
+
+		m_hold.clear();
+		m_was_written = false;
+		m_at_line_start = true;
+		m_lines_seen = 0;
+		m_skip_lines = m_opts.ignore_top ? head.size() : 0;
+		m_first_line_no = head.front().get_line_no();
+
+		if (m_opts.mark_start)
+			m_hold.append(m_opts.mark_start).append("\n");
+
+		return block_parser::LM_STREAM;
+	}
+
+	block_parser::line_mode block_line_done(
+		const block_parser::block_line& line
+	) override
+	{
+		if (!m_is_on)
+			return block_parser::LM_STORE;
+
+		if (++m_lines_seen > m_skip_lines)
+			p_hold_line(line, false);
+
+		if (m_hold.length() >= STREAM_HOLD_MAX)
+			p_write();
+
+		return block_parser::LM_STREAM;
+	}
+
+	void block_end(const block_parser::block_line * last) override
+	{
+		if (!m_is_on)
+			return;
+
+		if (!last)
+		{
+			m_is_partial = m_was_written;
+			m_hold.clear();
+			return;
 		}
+
+		// -I drops the last line
+		if (!m_opts.ignore_top)
+			p_hold_line(*last, true);
+
+		if (m_opts.mark_end)
+			m_hold.append(m_opts.mark_end).append("\n");
+
+		p_write();
+		std::cout.flush();
 	}
-	else if (match)
+
+private:
+	void p_hold_line(const block_parser::block_line& line, bool is_last)
 	{
-		return all_matched(match, block);
+		append_block_line(m_hold, m_opts, m_fname, line, is_last,
+			&m_at_line_start);
 	}
-	else if (dont_match)
+
+	void p_write()
 	{
-		return all_didnt_match(dont_match, block);
+		std::cout.write(m_hold.data(), m_hold.length());
+		m_hold.clear();
+		m_was_written = true;
 	}
 
-	return false;
+private:
+	std::string m_hold;
+	const prog_options& m_opts;
+	const char * m_fname;
+	size_t m_skip_lines;
+	size_t m_lines_seen;
+	size_t m_first_line_no;
+	bool m_is_on;
+	bool m_was_written;
+	bool m_is_partial;
+	bool m_at_line_start;
+};
+
+static void print_partial_block_err(const char * fname, size_t first_line_no)
+{
+	static std::string err;
+
+	err.clear();
+	if (fname)
+		err.append(fname).append(":");
+	err.append(std::to_string(first_line_no));
+	err.append(": block written in part before the error");
+	print_err(err.c_str());
 }
-// </match>
+// </stream>
 
-static bool process_a_block(
-	prog_options& opts,
-	const std::vector<std::unique_ptr<matcher>> * match,
-	const std::vector<std::unique_ptr<matcher>> * dont_match,
-	const std::vector<block_parser::block_line>& block
-)
+// Takes the blocks instead of them being printed, to print something about
+// all of them after the input is read.
+class block_collector
 {
-	if (match || dont_match)
+public:
+	virtual ~block_collector() {}
+	virtual void add(
+		const char * name,
+		size_t name_len,
+		const block_parser::block_span& span,
+		const char * fname
+	) = 0;
+};
+
+// <group>
+// --group-by-name; the blocks taken are summed up by the text of their names
+// in a hash map, so only one entry per name is kept, and a line for each is
+// printed at the end in name order. The files are read one after the other,
+// so the file with the most blocks of a name is found by comparing each run of
+// the name in a file with the best one so far.
+class name_groups : public block_collector
+{
+public:
+	void add(
+		const char * name,
+		size_t name_len,
+		const block_parser::block_span& span,
+		const char * fname
+	) override
 	{
-		if (!match_a_block(opts, match, dont_match, block))
-			return false;
-	}
+		m_key.assign(name, name_len);
+		auto it = m_groups.find(m_key);
+		if (m_groups.end() == it)
+			it = m_groups.emplace(m_key, group()).first;
 
-	bool should_print = false;
+		group& grp = it->second;
+		size_t lines = span.last_line - span.first_line + 1;
 
-	if (0 == opts.skip_count)
+		++grp.count;
+		grp.lines += lines;
+		grp.bytes += span.close_end_byte - span.name_byte;
+		if (lines > grp.max_lines)
+			grp.max_lines = lines;
+
+		if (!grp.file || 0 != strcmp(grp.file->c_str(), fname))
+		{
+			p_file_done(grp);
+			grp.file = p_file_name(fname);
+			grp.file_count = 0;
+		}
+		++grp.file_count;
+	}
+
+	// name, count, total lines, max lines, total bytes and the file with the
+	// most, tab separated
+	void print()
 	{
-		if (-1 == opts.block_count)
+		std::vector<const group_map::value_type *> order;
+		order.reserve(m_groups.size());
+		for (auto& ent : m_groups)
 		{
-			should_print = true;
+			p_file_done(ent.second);
+			order.push_back(&ent);
 		}
-		else if (opts.block_count > 0)
+
+		std::sort(order.begin(), order.end(),
+			[](const group_map::value_type * a, const group_map::value_type * b)
+			{return a->first < b->first;}
+		);
+
+		std::string out;
+		for (const auto * ent : order)
 		{
-			should_print = true;
-			--opts.block_count;
+			const group& grp = ent->second;
+			out.assign(ent->first).append("\t")
+				.append(std::to_string(grp.count)).append("\t")
+				.append(std::to_string(grp.lines)).append("\t")
+				.append(std::to_string(grp.max_lines)).append("\t")
+				.append(std::to_string(grp.bytes)).append("\t")
+				.append(*grp.top_file);
+			print_line(out.c_str());
 		}
 	}
-	else
+
+private:
+	struct group
 	{
-		--opts.skip_count;
+		size_t count = 0;
+		size_t lines = 0;
+		size_t max_lines = 0;
+		size_t bytes = 0;
+		const std::string * file = nullptr; // of the current run
+		size_t file_count = 0;
+		const std::string * top_file = nullptr;
+		size_t top_count = 0;
+	};
+
+	typedef std::unordered_map<std::string, group> group_map;
+
+	static void p_file_done(group& grp)
+	{
+		// a tie goes to the file read first
+		if (grp.file_count > grp.top_count)
+		{
+			grp.top_file = grp.file;
+			grp.top_count = grp.file_count;
+		}
 	}
 
-	return should_print;
-}
+	// the caller's buffer may be reused for the next file
+	const std::string * p_file_name(const char * fname)
+	{
+		if (m_files.empty() || m_files.back() != fname)
+			m_files.emplace_back(fname);
+		return &m_files.back();
+	}
 
-static process_result process_blocks_from_file(
-	block_parser& parser,
-	prog_options& opts,
-	const char * fname,
-	const std::vector<std::unique_ptr<matcher>> * match,
-	const std::vector<std::unique_ptr<matcher>> * dont_match
+private:
+	group_map m_groups;
+	std::deque<std::string> m_files;
+	std::string m_key;
+};
+// </group>
+
+// <index>
+// Everything the tokens of a file depend on; an index made with another hash
+// is not used.
+static uint64_t lexer_config_hash(
+	const prog_options& opts,
+	const patterns& pats
 )
 {
-	process_result res;
-	res.was_match = false;
-	res.was_err = false;
+	block_index::hasher hash;
+	const matcher * mtchr = nullptr;
 
-	parser.init(fname);
-	while (parser.parse_block())
+	hash.add(static_cast<uint64_t>(opts.which_lang));
+	for (int i = B_NAME; i <= STRING_RX; ++i)
 	{
-		if (0 == opts.block_count)
-			return res;
+		mtchr = pats.matchers[i];
+		hash.add(mtchr ? mtchr->pattern() : nullptr);
+		hash.add(mtchr ? mtchr->type_of() : nullptr);
+		hash.add(static_cast<uint64_t>(mtchr && mtchr->is_icase()));
+	}
 
+	return hash.get();
+}
+
+static block_index::entry index_entry(const block_parser::block_span& span)
+{
+	block_index::entry ent;
+	ent.name_byte = span.name_byte;
+	ent.name_end_byte = span.name_end_byte;
+	ent.open_byte = span.open_byte;
+	ent.close_end_byte = span.close_end_byte;
+	ent.first_line = span.first_line;
+	ent.last_line = span.last_line;
+	ent.depth = span.depth;
+	return ent;
+}
+
+static block_parser::block_span index_span(const block_index::entry& ent)
+{
+	block_parser::block_span span;
+	span.name_byte = ent.name_byte;
+	span.name_end_byte = ent.name_end_byte;
+	span.open_byte = ent.open_byte;
+	span.close_end_byte = ent.close_end_byte;
+	span.first_line = ent.first_line;
+	span.last_line = ent.last_line;
+	span.depth = ent.depth;
+	return span;
+}
+
+// The lines of an indexed block right from the mapped file; the whole lines,
+// or only the bytes from the name to the close with --sub-line. The lines
+// are not zero terminated, and are not looked for unless with_lines.
+static void index_block_lines(
+	const block_index& idx,
+	const block_index::entry& ent,
+	const prog_options& opts,
+	index_block& out,
+	bool with_lines = true
+)
+{
+	const char * data = idx.data();
+	size_t start = ent.name_byte;
+	size_t end = ent.close_end_byte;
+	const char * nl = nullptr;
+
+	out.span = index_span(ent);
+	out.name = data + ent.name_byte;
+	out.name_len = ent.name_end_byte - ent.name_byte;
+	out.lines.clear();
+	if (!with_lines)
+		return;
+
+	if (!opts.sub_line)
+		block_index::whole_lines(data, idx.data_size(), ent, &start, &end);
+
+	std::vector<block_parser::block_line>& lines = out.lines;
+	size_t line_no = ent.first_line;
+	size_t line_end = 0;
+	while (true)
+	{
+		nl = static_cast<const char *>(memchr(data + start, '\n', end - start));
+		line_end = nl ? nl - data : end;
+
+		lines.emplace_back(data + start, line_end - start, line_no++);
+		if (ent.open_byte >= start && ent.open_byte < line_end)
+			lines.back().mark_token(lexer::tok::OPEN);
+
+		if (!nl)
+			break;
+		start = line_end+1;
+	}
+}
+
+static void match_block_lines(
+	block_matcher& bmatch,
+	const std::vector<block_parser::block_line>& lines
+)
+{
+	bmatch.block_start(lines);
+	for (size_t i = 0, end = lines.size()-1; i < end; ++i)
+	{
+		if (block_parser::LM_SKIP == bmatch.block_line_done(lines[i]))
+			break;
+	}
+	bmatch.block_end(&lines.back());
+}
+
+// Text every match of an -m regex has in it. Only runs of plain characters
+// count, a character a quantifier can take away is left out, and nothing is
+// known about a pattern with an alternation.
+static void regex_literals(const char * rx, std::vector<std::string>& out)
+{
+	if (strchr(rx, '|'))
+		return;
+
+	std::string run;
+	auto flush = [&run, &out]() {
+		if (run.length() >= 3)
+			out.push_back(run);
+		run.clear();
+	};
+
+	int depth = 0;
+	char ch = '\0';
+	for (const char * pch = rx; *pch; ++pch)
+	{
+		ch = *pch;
+		if ('\\' == ch)
+		{
+			// \. is a '.', \d and \b and the like are not text
+			if (!pch[1])
+				break;
+
+			++pch;
+			if (ispunct(static_cast<unsigned char>(*pch)))
+			{
+				run.push_back(*pch);
+				continue;
+			}
+
+			// \x41, \u0041, \cA, \1, \k<name>, and \p{L} are not text, and
+			// neither is any of what follows the letter
+			flush();
+			ch = *pch;
+			if (('x' == ch || 'u' == ch || 'p' == ch || 'P' == ch)
+				&& '{' == pch[1])
+			{
+				while (pch[1] && '}' != pch[1])
+					++pch;
+				pch += (0 != pch[1]);
+			}
+			else if ('x' == ch || 'u' == ch)
+			{
+				for (int n = ('x' == ch) ? 2 : 4;
+					n && isxdigit(static_cast<unsigned char>(pch[1])); --n)
+				{
+					++pch;
+				}
+			}
+			else if ('c' == ch)
+			{
+				pch += (0 != pch[1]);
+			}
+			else if ('k' == ch && '<' == pch[1])
+			{
+				while (pch[1] && '>' != pch[1])
+					++pch;
+				pch += (0 != pch[1]);
+			}
+			else if (isdigit(static_cast<unsigned char>(ch)))
+			{
+				while (isdigit(static_cast<unsigned char>(pch[1])))
+					++pch;
+			}
+		}
+		else if ('[' == ch)
+		{
+			// a class is one character, whatever is in it
+			flush();
+			while (pch[1] && ']' != pch[1])
+				pch += ('\\' == pch[1] && pch[2]) ? 2 : 1;
+			pch += (0 != pch[1]);
+		}
+		else if ('(' == ch)
+		{
+			// a group may be optional, what's in it is skipped
+			flush();
+			for (depth = 1; depth && pch[1]; ++pch)
+			{
+				if ('\\' == pch[1] && pch[2])
+					++pch;
+				else if ('(' == pch[1])
+					++depth;
+				else if (')' == pch[1])
+					--depth;
+			}
+		}
+		else if ('*' == ch || '?' == ch || '{' == ch)
+		{
+			if (!run.empty())
+				run.pop_back();
+			flush();
+
+			if ('{' == ch)
+			{
+				while (pch[1] && '}' != pch[1])
+					++pch;
+				pch += (0 != pch[1]);
+			}
+		}
+		else if ('+' == ch || '.' == ch || '^' == ch || '$' == ch || ')' == ch)
+		{
+			flush();
+		}
+		else
+		{
+			run.push_back(ch);
+		}
+	}
+	flush();
+}
+
+// The text every -m needs in a block, when only the blocks with all of it
+// can match.
+static void match_literals(
+	const prog_options& opts,
+	const patterns& pats,
+	std::vector<std::string>& out
+)
+{
+	out.clear();
+
+	bool can_skip = (!pats.mM_vect.match.empty()
+		&& (pats.mM_vect.dont_match.empty()
+			|| opts.match_how.and_mM_together));
+
+	if (!can_skip)
+		return;
+
+	const char * pat = nullptr;
+	for (const auto& mtchr : pats.mM_vect.match)
+	{
+		if (!mtchr)
+			continue;
+
+		pat = mtchr->pattern();
+		if (0 == strcmp(mtchr->type_of(), "regex"))
+			regex_literals(pat, out);
+		else if (strlen(pat) >= 3)
+			out.emplace_back(pat);
+	}
+}
+
+// The blocks of an index with their names in range are [*out_first, *out_end);
+// they are in file order, so they're searched for.
+static void index_range(
+	const block_index& idx,
+	const block_parser::name_range& range,
+	size_t * out_first,
+	size_t * out_end
+)
+{
+	auto is_before = [&range](const block_index::entry& ent) {
+		return (ent.name_byte < range.first_byte
+			|| ent.first_line < range.first_line);
+	};
+
+	auto is_in = [&range](const block_index::entry& ent) {
+		return (ent.name_byte < range.end_byte
+			&& ent.first_line <= range.last_line);
+	};
+
+	size_t lo = 0;
+	size_t hi = idx.size();
+	size_t mid = 0;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo)/2;
+		if (is_before(idx.get(mid)))
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	*out_first = lo;
+
+	hi = idx.size();
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo)/2;
+		if (is_in(idx.get(mid)))
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	*out_end = lo;
+}
+
+// A file with a good index is never lexed and has no nesting errors. With
+// trigrams in the index only the blocks which can match are read.
+static process_result process_blocks_from_index(
+	const block_index& idx,
+	prog_options& opts,
+	const char * fname,
+	block_matcher * bmatch,
+	const std::vector<std::string>& literals,
+	const block_parser::name_range& range,
+	block_index::writer * cache_writer,
+	block_collector * collector
+)
+{
+	process_result res;
+	res.count = 0;
+	res.was_match = false;
+	res.was_err = false;
+
+	block_printer printer(opts);
+	index_block blk;
+	std::vector<uint32_t> cands;
+	bool use_cands = (bmatch && idx.candidates(literals, cands));
+	bool with_lines = (bmatch || stores_lines(opts));
+
+	size_t first = 0;
+	size_t last = 0;
+	index_range(idx, range, &first, &last);
+
+	for (size_t n = use_cands ? 0 : first, i = 0,
+		end = use_cands ? cands.size() : last; n < end; ++n)
+	{
+		i = use_cands ? cands[n] : n;
+		if (i < first)
+			continue;
+		else if (i >= last)
+			break;
+
+		index_block_lines(idx, idx.get(i), opts, blk, with_lines);
+		if (bmatch)
+			match_block_lines(*bmatch, blk.lines);
+
+		if (process_a_block(opts, bmatch))
+		{
+			++res.count;
+			res.was_match = true;
+			if (cache_writer)
+				cache_writer->add(idx.get(i));
+
+			if (opts.files_with_match)
+			{
+				print_line(fname);
+				return res;
+			}
+			else if (collector)
+			{
+				collector->add(blk.name, blk.name_len, blk.span, fname);
+			}
+			else if (!opts.files_without_match && !opts.check
+				&& OUTPUT_COUNT != opts.output)
+			{
+				printer.print(blk, fname);
+			}
+		}
+
+		if (0 == opts.block_count)
+			break;
+	}
+
+	if (!res.was_match && opts.files_without_match)
+		print_line(fname);
+
+	if (OUTPUT_COUNT == opts.output)
+		print_count(fname, res.count);
+
+	return res;
+}
+// </index>
+
+// <top>
+// --top-k; only the k biggest blocks are kept, and only where they are, in a
+// heap with the smallest on top. Their lines are read back from the files
+// after all input is, so the memory is the same whatever the blocks are.
+class top_blocks : public block_collector
+{
+public:
+	struct desc
+	{
+		std::string file;
+		block_index::entry ent;
+		size_t size;
+		size_t seq; // of the block among all taken; a tie goes to the first
+	};
+
+	top_blocks(size_t k, bool by_bytes) :
+		m_k(k),
+		m_seq(0),
+		m_by_bytes(by_bytes)
+	{}
+
+	void add(
+		const char * name,
+		size_t name_len,
+		const block_parser::block_span& span,
+		const char * fname
+	) override
+	{
+		desc cand;
+		cand.size = m_by_bytes ? span.close_end_byte - span.name_byte
+			: span.last_line - span.first_line + 1;
+		cand.seq = m_seq++;
+
+		if (m_heap.size() == m_k)
+		{
+			if (!is_bigger(cand, m_heap.front()))
+				return;
+			std::pop_heap(m_heap.begin(), m_heap.end(), is_bigger);
+		}
+		else
+		{
+			m_heap.emplace_back();
+		}
+
+		// the string of the one dropped is reused
+		desc& dest = m_heap.back();
+		dest.file.assign(fname);
+		dest.ent = index_entry(span);
+		dest.size = cand.size;
+		dest.seq = cand.seq;
+		std::push_heap(m_heap.begin(), m_heap.end(), is_bigger);
+	}
+
+	// the biggest first; the heap is used up
+	const std::vector<desc>& sorted()
+	{
+		std::sort_heap(m_heap.begin(), m_heap.end(), is_bigger);
+		return m_heap;
+	}
+
+private:
+	static bool is_bigger(const desc& a, const desc& b)
+	{
+		return (a.size > b.size || (a.size == b.size && a.seq < b.seq));
+	}
+
+private:
+	std::vector<desc> m_heap;
+	size_t m_k;
+	size_t m_seq;
+	bool m_by_bytes;
+};
+
+// Where the line with byte in it starts in the file.
+static size_t line_start(std::ifstream& in, size_t byte)
+{
+	static char buff[4096];
+
+	size_t len = 0;
+	while (byte > 0 && in)
+	{
+		len = (byte > sizeof(buff)) ? sizeof(buff) : byte;
+		in.seekg(byte - len);
+		if (!in.read(buff, len))
+			break;
+
+		for (size_t i = len; i > 0; --i)
+		{
+			if ('\n' == buff[i-1])
+				return byte - len + i;
+		}
+		byte -= len;
+	}
+	return byte;
+}
+
+// Prints a block read back from its file a line at a time, so a big one is
+// never all in memory; the whole lines, or only the bytes from the name to the
+// close with --sub-line. Throws std::runtime_error.
+static void print_block_back(
+	block_printer& printer,
+	const prog_options& opts,
+	const top_blocks::desc& top
+)
+{
+	static std::string name;
+	static std::string line;
+
+	const char * fname = top.file.c_str();
+	const block_index::entry& ent = top.ent;
+	std::ifstream in(fname, std::ios::binary);
+
+	name.resize(ent.name_end_byte - ent.name_byte);
+	in.seekg(ent.name_byte);
+	in.read(&name[0], name.size());
+
+	std::error_code err;
+	if (!in || std::filesystem::file_size(fname, err) < ent.close_end_byte
+		|| err)
+	{
+		throw std::runtime_error(
+			std::string(fname).append(": cannot read a block back, ")
+				.append("the file has changed")
+		);
+	}
+
+	printer.begin(fname, index_span(ent), name.data(), name.length());
+	if (prints_lines(opts))
+	{
+		size_t pos = opts.sub_line ? ent.name_byte
+			: line_start(in, ent.name_byte);
+		size_t line_no = ent.first_line;
+		size_t len = 0;
+		bool is_last = false;
+
+		in.clear();
+		in.seekg(pos);
+		while (!is_last && std::getline(in, line))
+		{
+			len = line.length();
+			is_last = (ent.close_end_byte <= pos + len);
+			if (is_last && opts.sub_line)
+				len = ent.close_end_byte - pos;
+
+			block_parser::block_line bline(line.c_str(), len, line_no++);
+			if (ent.open_byte >= pos && ent.open_byte < pos + len)
+				bline.mark_token(lexer::tok::OPEN);
+
+			printer.visit(bline, is_last);
+			pos += line.length() + 1;
+		}
+	}
+	printer.end();
+}
+
+// The biggest blocks, biggest first. Where the blocks are is printed without
+// reading them.
+static void print_top_blocks(top_blocks& tops, const prog_options& opts)
+{
+	block_printer printer(opts);
+
+	for (const auto& top : tops.sorted())
+	{
+		if (OUTPUT_OFFSETS == opts.output)
+		{
+			printer.begin(top.file.c_str(), index_span(top.ent), nullptr, 0);
+			printer.end();
+		}
+		else
+		{
+			print_block_back(printer, opts, top);
+		}
+	}
+}
+// </top>
+
+// <cache>
+// A result cache is a block index per file and query, kept in the cache
+// directory, of the blocks the query took from the file. It's good for as
+// long as the index is, so an unchanged file is answered without matching.
+static uint64_t query_hash(
+	const prog_options& opts,
+	const patterns& pats,
+	uint64_t lexer_hash
+)
+{
+	block_index::hasher hash;
+	hash.add(lexer_hash);
+
+	for (const auto * vect : {&pats.mM_vect.match, &pats.mM_vect.dont_match})
+	{
+		hash.add(static_cast<uint64_t>(vect->size()));
+		for (const auto& mtchr : *vect)
+		{
+			hash.add(mtchr ? mtchr->pattern() : nullptr);
+			hash.add(mtchr ? mtchr->type_of() : nullptr);
+			hash.add(static_cast<uint64_t>(mtchr && mtchr->is_icase()));
+		}
+	}
+
+	hash.add(static_cast<uint64_t>(opts.match_how.and_mM_together));
+	hash.add(static_cast<uint64_t>(opts.block_count));
+	hash.add(static_cast<uint64_t>(opts.skip_count));
+	hash.add(static_cast<uint64_t>(opts.sub_line));
+	hash.add(static_cast<uint64_t>(opts.files_with_match));
+	hash.add(static_cast<uint64_t>(opts.files_without_match));
+	hash.add(static_cast<uint64_t>(opts.check));
+	hash.add(static_cast<uint64_t>(opts.ignore_top));
+
+	// how the blocks are printed is not cached, but it's part of the query
+	hash.add(static_cast<uint64_t>(nullptr != opts.mark_start));
+	hash.add(opts.mark_start);
+	hash.add(static_cast<uint64_t>(nullptr != opts.mark_end));
+	hash.add(opts.mark_end);
+	hash.add(static_cast<uint64_t>(opts.line_numbers));
+	hash.add(static_cast<uint64_t>(opts.with_filename));
+
+	return hash.get();
+}
+
+static void cache_file_name(
+	const prog_options& opts,
+	const char * fname,
+	uint64_t query,
+	std::string& out
+)
+{
+	static char hex[32];
+
+	block_index::hasher hash;
+	hash.add(std::filesystem::absolute(fname).c_str());
+	hash.add(query);
+	snprintf(hex, sizeof(hex), "%016llx",
+		static_cast<unsigned long long>(hash.get()));
+
+	out.assign(opts.cache_dir).append("/").append(hex);
+}
+
+// The blocks a query took from the file the last time are printed the same
+// way, only nothing is matched and nothing is counted again.
+static process_result process_blocks_from_cache(
+	const block_index& idx,
+	const prog_options& opts,
+	const char * fname,
+	block_collector * collector
+)
+{
+	process_result res;
+	res.count = idx.size();
+	res.was_match = (idx.size() > 0);
+	res.was_err = false;
+
+	if (opts.files_with_match || opts.files_without_match)
+	{
+		if (res.was_match == opts.files_with_match)
+			print_line(fname);
+	}
+	else if (OUTPUT_COUNT == opts.output)
+	{
+		print_count(fname, res.count);
+	}
+	else if (!opts.check)
+	{
+		block_printer printer(opts);
+		index_block blk;
+
+		for (size_t i = 0, end = idx.size(); i < end; ++i)
+		{
+			index_block_lines(idx, idx.get(i), opts, blk,
+				stores_lines(opts));
+
+			if (collector)
+				collector->add(blk.name, blk.name_len, blk.span, fname);
+			else
+				printer.print(blk, fname);
+		}
+	}
+
+	return res;
+}
+// </cache>
+
+// <state>
+// A --state-file has a line for each file read: its inode and its size then,
+// the byte just past the last block without an error and the line of that
+// byte, and the absolute name of the file. The next read of the file starts
+// there with a fresh parser, unless the file was replaced or truncated.
+struct file_state
+{
+	uint64_t ino;
+	uint64_t size;
+	uint64_t byte;
+	uint64_t line;
+};
+
+typedef std::map<std::string, file_state> state_map;
+
+static void read_state_file(const char * fname, state_map& out)
+{
+	std::ifstream in(fname);
+	if (!in.is_open())
+	{
+		if (ENOENT == errno)
+			return;
+
+		throw std::runtime_error(
+			std::string(fname).append(": ").append(strerror(errno))
+		);
+	}
+
+	std::string line;
+	file_state st;
+	size_t line_no = 0;
+	int name = 0;
+	while (std::getline(in, line))
+	{
+		++line_no;
+		if (sscanf(line.c_str(), "%" SCNu64 " %" SCNu64 " %" SCNu64
+			" %" SCNu64 " %n", &st.ino, &st.size, &st.byte, &st.line, &name) < 4
+			|| !name || !line[name] || !st.line)
+		{
+			throw std::runtime_error(
+				std::string(fname).append(":").append(std::to_string(line_no))
+					.append(": bad state line")
+			);
+		}
+		out[line.substr(name)] = st;
+	}
+}
+
+static void write_state_file(const char * fname, const state_map& states)
+{
+	std::string tmp(fname);
+	tmp.append(".tmp.").append(std::to_string(getpid()));
+
+	std::ofstream out(tmp);
+	for (const auto& ent : states)
+	{
+		out << ent.second.ino << ' ' << ent.second.size << ' '
+			<< ent.second.byte << ' ' << ent.second.line << ' '
+			<< ent.first << '\n';
+	}
+	out.close();
+
+	if (!out || rename(tmp.c_str(), fname) != 0)
+	{
+		std::string err(fname);
+		err.append(": ").append(strerror(errno));
+		unlink(tmp.c_str());
+		throw std::runtime_error(err);
+	}
+}
+
+// opens fname and takes now from the file which was opened; the name is
+// looked at before and after, and opened again when another file took it in
+// between, since an ifstream has no descriptor to fstat
+#define STATE_OPEN_TRIES 3
+
+static bool state_open(std::ifstream& in, const char * fname, struct stat& now)
+{
+	struct stat after;
+	for (int i = 0; i < STATE_OPEN_TRIES; ++i)
+	{
+		if (stat(fname, &now) != 0)
+			return false;
+
+		in.open(fname);
+		if (!in.is_open())
+			return false;
+
+		if (stat(fname, &after) != 0)
+			break;
+
+		if (now.st_dev == after.st_dev && now.st_ino == after.st_ino)
+			return true;
+
+		in.close();
+		in.clear();
+	}
+
+	// still moving; the start is what's read, not where it stopped
+	now.st_ino = 0;
+	if (!in.is_open())
+		in.open(fname);
+	return in.is_open();
+}
+
+// where the file opened as now starts; the inode and the size are updated to
+// what it was when opened
+static void state_start(file_state& st, const struct stat& now)
+{
+	if (!now.st_ino || st.ino != static_cast<uint64_t>(now.st_ino)
+		|| st.size > static_cast<uint64_t>(now.st_size)
+		|| st.byte > static_cast<uint64_t>(now.st_size)
+		|| !st.line)
+	{
+		st.byte = 0;
+		st.line = 1;
+	}
+
+	st.ino = now.st_ino;
+	st.size = now.st_size;
+}
+// </state>
+
+// <batch>
+// Every --batch query has its own matchers and counts. They all see the lines
+// of the same parsed block, so the input is read and lexed once, and each
+// prints what it takes under its own name.
+struct batch_query
+{
+	prog_options opts;
+	mM_matchers_vect pats;
+	std::unique_ptr<block_matcher> bmatch;
+	int block_count;
+	int skip_count;
+	bool was_match;
+	bool is_done;
+};
+
+typedef std::vector<std::unique_ptr<batch_query>> batch_queries;
+
+static void make_batch_queries(
+	const std::vector<prog_options>& queries,
+	batch_queries& out
+)
+{
+	for (const auto& query : queries)
+	{
+		out.emplace_back(new batch_query());
+		batch_query& bq = *out.back();
+
+		bq.opts = query;
+		for (const auto& data : bq.opts.mM_vect.match)
+			bq.pats.match.emplace_back(make_a_pattern(&data));
+
+		for (const auto& data : bq.opts.mM_vect.dont_match)
+			bq.pats.dont_match.emplace_back(make_a_pattern(&data));
+
+		bq.bmatch.reset(new block_matcher(
+			bq.pats.match.empty() ? nullptr : &bq.pats.match,
+			bq.pats.dont_match.empty() ? nullptr : &bq.pats.dont_match,
+			bq.opts.match_how.and_mM_together,
+			bq.opts.sub_line,
+			bq.opts.verbose_error
+		));
+
+		bq.block_count = bq.opts.block_count;
+		bq.skip_count = bq.opts.skip_count;
+		bq.was_match = false;
+		bq.is_done = false;
+	}
+}
+
+// Lines are stored while any query may still take the block.
+class batch_sink : public block_parser::line_sink
+{
+public:
+	batch_sink(batch_queries& queries) :
+		m_queries(queries)
+	{}
+
+	block_parser::line_mode block_start(
+		const std::vector<block_parser::block_line>& head
+	) override
+	{
+		for (auto& bq : m_queries)
+		{
+			if (!bq->is_done)
+				bq->bmatch->block_start(head);
+		}
+		return block_parser::LM_STORE;
+	}
+
+	block_parser::line_mode block_line_done(
+		const block_parser::block_line& line
+	) override
+	{
+		block_parser::line_mode mode = block_parser::LM_SKIP;
+		for (auto& bq : m_queries)
+		{
+			if (!bq->is_done
+				&& block_parser::LM_STORE == bq->bmatch->block_line_done(line))
+			{
+				mode = block_parser::LM_STORE;
+			}
+		}
+		return mode;
+	}
+
+	void block_end(const block_parser::block_line * last) override
+	{
+		for (auto& bq : m_queries)
+		{
+			if (!bq->is_done)
+				bq->bmatch->block_end(last);
+		}
+	}
+
+private:
+	batch_queries& m_queries;
+};
+
+static void batch_print_file_name(const batch_query& bq, const char * fname)
+{
+	static std::string out;
+	out.assign(bq.opts.label).append(":").append(fname);
+	print_line(out.c_str());
+}
+
+static void batch_file_start(batch_queries& queries)
+{
+	for (auto& bq : queries)
+	{
+		bq->opts.block_count = bq->block_count;
+		bq->opts.skip_count = bq->skip_count;
+		bq->was_match = false;
+		bq->is_done = (0 == bq->block_count);
+	}
+}
+
+static bool batch_file_end(batch_queries& queries, const char * fname)
+{
+	bool was_match = false;
+	for (auto& bq : queries)
+	{
+		if (!bq->was_match && bq->opts.files_without_match)
+			batch_print_file_name(*bq, fname);
+		was_match = (was_match || bq->was_match);
+	}
+	return was_match;
+}
+
+// Prints the block, from the parser or from an index, for every query which
+// takes it; false once no query can take any more blocks from the file.
+template <typename T>
+static bool batch_take_block(
+	batch_queries& queries,
+	T& block,
+	const char * fname
+)
+{
+	bool is_all_done = true;
+	for (auto& pbq : queries)
+	{
+		batch_query& bq = *pbq;
+		if (!bq.is_done && process_a_block(bq.opts, bq.bmatch.get()))
+		{
+			bq.was_match = true;
+			if (bq.opts.files_with_match)
+			{
+				batch_print_file_name(bq, fname);
+				bq.is_done = true;
+			}
+			else if (!bq.opts.files_without_match)
+			{
+				block_printer(bq.opts).print(block, fname);
+			}
+
+			if (0 == bq.opts.block_count)
+				bq.is_done = true;
+		}
+		is_all_done = (is_all_done && bq.is_done);
+	}
+	return !is_all_done;
+}
+
+static process_result process_batch_from_file(
+	block_parser& parser,
+	const prog_options& opts,
+	batch_queries& queries,
+	const char * fname
+)
+{
+	process_result res;
+	res.count = 0;
+	res.was_match = false;
+	res.was_err = false;
+
+	batch_file_start(queries);
+
+	parser.init(fname);
+	while (parser.parse_block())
+	{
+		if (parser.had_error())
+		{
+			res.was_err = true;
+			if (opts.verbose_error)
+				print_block_stderr(parser);
+
+			print_error_report(parser.get_error_report());
+
+			if (opts.fatal_error)
+				fatal_error_exit();
+		}
+		else if (!batch_take_block(queries, parser, fname))
+		{
+			break;
+		}
+	}
+
+	res.was_match = batch_file_end(queries, fname);
+	return res;
+}
+
+static process_result process_batch_from_index(
+	const block_index& idx,
+	batch_queries& queries,
+	const char * fname,
+	const block_parser::name_range& range
+)
+{
+	process_result res;
+	res.count = 0;
+	res.was_match = false;
+	res.was_err = false;
+
+	index_block blk;
+
+	size_t first = 0;
+	size_t last = 0;
+	index_range(idx, range, &first, &last);
+
+	batch_file_start(queries);
+	for (size_t i = first; i < last; ++i)
+	{
+		index_block_lines(idx, idx.get(i), queries.front()->opts, blk);
+		for (auto& bq : queries)
+		{
+			if (!bq->is_done)
+				match_block_lines(*bq->bmatch, blk.lines);
+		}
+
+		if (!batch_take_block(queries, blk, fname))
+			break;
+	}
+
+	res.was_match = batch_file_end(queries, fname);
+	return res;
+}
+// </batch>
+
+static process_result process_blocks_from_file(
+	block_parser& parser,
+	prog_options& opts,
+	const char * fname,
+	block_matcher * bmatch,
+	block_streamer * streamer,
+	block_index::writer * idx_writer,
+	block_index::writer * cache_writer,
+	block_collector * collector
+)
+{
+	process_result res;
+	res.count = 0;
+	res.was_match = false;
+	res.was_err = false;
+
+	block_printer printer(opts);
+
+	if (streamer)
+		streamer->set_file(fname);
+
+	if (idx_writer)
+		idx_writer->reset();
+
+	parser.init(fname);
+	while (parser.parse_block())
+	{
 		if (parser.had_error())
 		{
 			res.was_err = true;
 			if (opts.verbose_error)
-				print_block_stderr(parser.get_block());
+				print_block_stderr(parser);
 
 			print_error_report(parser.get_error_report());
 
+			if (streamer && streamer->was_partial())
+				print_partial_block_err(fname, streamer->first_line_no());
+
 			if (opts.fatal_error)
 				fatal_error_exit();
 		}
 		else
 		{
-			if (process_a_block(
-					opts,
-					match,
-					dont_match,
-					parser.get_block()
-				))
+			if (idx_writer)
+				idx_writer->add(index_entry(parser.get_span()));
+
+			if (process_a_block(opts, bmatch))
 			{
+				++res.count;
 				res.was_match = true;
+				if (cache_writer)
+					cache_writer->add(index_entry(parser.get_span()));
+
 				if (opts.files_with_match)
 				{
 					print_line(fname);
 					return res;
 				}
-				else if (!opts.files_without_match)
+				else if (collector)
+				{
+					const std::string& name = parser.get_name();
+					collector->add(name.data(), name.length(),
+						parser.get_span(), fname);
+				}
+				else if (!opts.files_without_match && !opts.check
+					&& OUTPUT_COUNT != opts.output
+					&& !(streamer && streamer->was_streamed()))
 				{
-					print_block(opts, fname, parser.get_block());
+					printer.print(parser, fname);
 				}
 			}
 		}
+
+		// -c is used up; don't read any further, stdin included
+		if (0 == opts.block_count)
+			break;
 	}
 
 	if (!res.was_match && opts.files_without_match)
 		print_line(fname);
 
+	if (OUTPUT_COUNT == opts.output)
+		print_count(fname, res.count);
+
 	return res;
 }
 
-static void process_file(
+static void add_result(process_result& total, const process_result& curr)
+{
+	total.count += curr.count;
+
+	if (!total.was_match)
+		total.was_match = curr.was_match;
+
+	if (!total.was_err)
+		total.was_err = curr.was_err;
+}
+
+static process_result process_file(
 	process_result& total,
 	block_parser& parser,
 	prog_options& opts,
 	const char * fname,
-	const std::vector<std::unique_ptr<matcher>> * match,
-	const std::vector<std::unique_ptr<matcher>> * dont_match
+	block_matcher * bmatch,
+	block_streamer * streamer,
+	block_index::writer * idx_writer,
+	block_index::writer * cache_writer,
+	block_collector * collector
 )
 {
-	process_result curr = process_blocks_from_file(
+	static std::string err;
+
+	process_result curr;
+	curr.count = 0;
+	curr.was_match = false;
+	curr.was_err = true;
+
+	if (idx_writer && 0 == strcmp(fname, str_stdin))
+	{
+		print_err("cannot build an index for stdin");
+		add_result(total, curr);
+		return curr;
+	}
+
+	curr = process_blocks_from_file(
 		parser,
 		opts,
 		fname,
-		match,
-		dont_match
+		bmatch,
+		streamer,
+		idx_writer,
+		cache_writer,
+		collector
 	);
 
-	if (!total.was_match)
-		total.was_match = curr.was_match;
+	add_result(total, curr);
 
-	if (!total.was_err)
-		total.was_err = curr.was_err;
+	// the blocks after an error may not be where the index would say
+	if (idx_writer)
+	{
+		if (curr.was_err)
+		{
+			err.assign(fname).append(": index not written due to errors");
+			print_err(err.c_str());
+		}
+		else if (!idx_writer->write(fname))
+		{
+			err.assign(fname).append(": index not written, changed while read");
+			print_err(err.c_str());
+			total.was_err = true;
+		}
+	}
+
+	return curr;
 }
 
 static int process(
 	prog_options& opts,
 	const patterns& pats,
+	const std::vector<prog_options>& queries,
 	const std::vector<const char *>& file_names
 )
 {
@@ -635,12 +2378,14 @@ static int process(
 
 	bool was_file_open_err = false;
 	process_result total;
+	total.count = 0;
 	total.was_match = false;
 	total.was_err = false;
 
 	const char * current_file = str_stdin;
 
 	std::ifstream file_in_stream;
+	std::unique_ptr<follow_buff> follow_in;
 	std::istream generic_in_stream(std::cin.rdbuf());
 
 	lexer::matchers lex_matchers(
@@ -653,24 +2398,106 @@ static int process(
 		static_cast<const regex_matcher *>(pats.matchers[STRING_RX])
 	);
 
-	lexer lex(generic_in_stream, lex_matchers);
-	block_parser b_parser(lex);
+	std::unique_ptr<lexer> lex(
+		make_lexer(opts, generic_in_stream, lex_matchers)
+	);
+	lex->set_piece_max(opts.sub_line);
+	block_parser b_parser(*lex);
+	b_parser.set_max_block_memory(opts.max_block_mem);
+
+	block_parser::name_range range = name_range(opts);
+	b_parser.set_range(range);
+
+	// a block to match is stored until it's printed; without -m/-M a block
+	// is streamed or skipped, unless -V has to print it on error
+	block_matcher bmatch(
+		v_match,
+		v_dont_match,
+		opts.match_how.and_mM_together,
+		opts.sub_line,
+		opts.verbose_error
+	);
+	bmatch.set_store(stores_lines(opts));
+	block_matcher * p_bmatch = nullptr;
+	block_streamer streamer(opts);
+	block_streamer * p_streamer = nullptr;
+
+	warm_cache& warm = get_warm_cache();
+	block_index idx;
+	block_index * p_idx = nullptr;
+	block_index::writer idx_writer(
+		lexer_config_hash(opts, pats),
+		opts.index_trigrams
+	);
+	block_index::writer * p_idx_writer =
+		opts.build_index ? &idx_writer : nullptr;
+	std::vector<std::string> literals;
+	match_literals(opts, pats, literals);
+
+	block_index::writer cache_writer(
+		query_hash(opts, pats, idx_writer.get_config_hash())
+	);
+	block_index::writer * p_cache_writer = nullptr;
+	std::string cache_name;
+
+	state_map states;
+	file_state * p_state = nullptr;
+	struct stat st_now;
+	if (opts.state_file)
+		read_state_file(opts.state_file, states);
+
+	name_groups groups;
+	top_blocks tops(opts.top_k, TOP_BY_BYTES == opts.top_by);
+	block_collector * p_collector = nullptr;
+	if (OUTPUT_GROUP == opts.output)
+		p_collector = &groups;
+	else if (opts.top_k)
+		p_collector = &tops;
+
+	batch_queries batch;
+	make_batch_queries(queries, batch);
+	batch_sink bsink(batch);
+
+	if (!batch.empty())
+	{
+		b_parser.set_sink(&bsink);
+	}
+	else if ((v_match || v_dont_match) && !opts.check)
+	{
+		p_bmatch = &bmatch;
+		b_parser.set_sink(p_bmatch);
+	}
+	else if (!opts.verbose_error)
+	{
+		p_streamer = &streamer;
+		b_parser.set_sink(p_streamer);
+	}
 
-	if (!file_names.size())
+	if (!file_names.size() && !batch.empty())
+	{
+		add_result(
+			total,
+			process_batch_from_file(b_parser, opts, batch, current_file)
+		);
+	}
+	else if (!file_names.size())
 	{
 		process_file(
 			total,
 			b_parser,
 			opts,
 			current_file,
-			v_match,
-			v_dont_match
+			p_bmatch,
+			p_streamer,
+			p_idx_writer,
+			p_cache_writer,
+			p_collector
 		);
 	}
 	else
 	{
 		static std::string err;
-
+		process_result curr;
 
 		for (auto& fname : file_names)
 		{
@@ -683,13 +2510,109 @@ static int process(
 				continue;
 			}
 
+			// counts per file
+			int block_count = opts.block_count;
+			int skip_count = opts.skip_count;
+
+			// an unchanged file is answered from the cache
+			p_cache_writer = nullptr;
+			if (opts.cache_dir && !opts.build_index
+				&& 0 != strcmp(current_file, str_stdin))
+			{
+				cache_file_name(
+					opts,
+					current_file,
+					cache_writer.get_config_hash(),
+					cache_name
+				);
+
+				p_idx = warm.open_index(idx, current_file,
+					cache_writer.get_config_hash(), cache_name.c_str());
+				if (p_idx)
+				{
+					add_result(
+						total,
+						process_blocks_from_cache(*p_idx, opts, current_file,
+							p_collector)
+					);
+					idx.close();
+					continue;
+				}
+
+				cache_writer.reset();
+				cache_writer.take_source(current_file);
+				p_cache_writer = &cache_writer;
+			}
+
+			// a file with a good index is not lexed
+			if (!opts.build_index && !opts.follow && !opts.state_file
+				&& 0 != strcmp(current_file, str_stdin)
+				&& (p_idx = warm.open_index(idx, current_file,
+					idx_writer.get_config_hash())))
+			{
+				if (!batch.empty())
+				{
+					add_result(
+						total,
+						process_batch_from_index(*p_idx, batch, current_file,
+							range)
+					);
+					idx.close();
+					continue;
+				}
+
+				curr = process_blocks_from_index(
+					*p_idx,
+					opts,
+					current_file,
+					p_bmatch,
+					literals,
+					range,
+					p_cache_writer,
+					p_collector
+				);
+				add_result(total, curr);
+				idx.close();
+
+				if (p_cache_writer)
+					p_cache_writer->write(current_file, cache_name.c_str());
+
+				opts.block_count = block_count;
+				opts.skip_count = skip_count;
+				continue;
+			}
+
+			// --state-file starts where the last run stopped
+			p_state = nullptr;
+			lex->set_start(0, 0);
+			if (opts.state_file && 0 != strcmp(current_file, str_stdin))
+			{
+				p_state = &states[
+					std::filesystem::absolute(current_file).string()
+				];
+			}
+
 			if (0 == strcmp(current_file, str_stdin))
 			{
 				generic_in_stream.rdbuf(std::cin.rdbuf());
 			}
+			else if (opts.follow)
+			{
+				follow_in.reset(new follow_buff(current_file));
+				generic_in_stream.rdbuf(follow_in.get());
+			}
 			else
 			{
-				file_in_stream.open(current_file);
+				if (p_idx_writer)
+					p_idx_writer->take_source(current_file);
+
+				if (!p_state)
+					file_in_stream.open(current_file);
+				else if (state_open(file_in_stream, current_file, st_now))
+					state_start(*p_state, st_now);
+				else
+					*p_state = file_state{0, 0, 0, 1};
+
 				if (file_in_stream.is_open())
 				{
 					generic_in_stream.rdbuf(file_in_stream.rdbuf());
@@ -704,20 +2627,53 @@ static int process(
 				}
 			}
 
-			// counts per file
-			int block_count = opts.block_count;
-			int skip_count = opts.skip_count;
-			process_file(
-				total,
-				b_parser,
-				opts,
-				current_file,
-				v_match,
-				v_dont_match
-			);
+			if (p_state && p_state->byte)
+			{
+				file_in_stream.seekg(p_state->byte);
+				lex->set_start(p_state->line-1, p_state->byte);
+			}
+
+			// --follow starts over with a new or truncated file
+			do
+			{
+				generic_in_stream.clear();
+				if (!batch.empty())
+				{
+					add_result(
+						total,
+						process_batch_from_file(b_parser, opts, batch,
+							current_file)
+					);
+				}
+				else
+				{
+					curr = process_file(
+						total,
+						b_parser,
+						opts,
+						current_file,
+						p_bmatch,
+						p_streamer,
+						p_idx_writer,
+						p_cache_writer,
+						p_collector
+					);
+				}
+			} while (follow_in && 0 != opts.block_count
+				&& follow_in->next_file());
 			opts.block_count = block_count;
 			opts.skip_count = skip_count;
 
+			if (p_state)
+			{
+				p_state->byte = b_parser.get_resume_byte();
+				p_state->line = b_parser.get_resume_line();
+			}
+
+			// errors are reported every time
+			if (p_cache_writer && !curr.was_err)
+				p_cache_writer->write(current_file, cache_name.c_str());
+
 			if (file_in_stream.is_open())
 			{
 				file_in_stream.close();
@@ -726,6 +2682,17 @@ static int process(
 		}
 	}
 
+	if (opts.state_file)
+		write_state_file(opts.state_file, states);
+
+	if (opts.count_total)
+		print_count("total", total.count);
+
+	if (OUTPUT_GROUP == opts.output)
+		groups.print();
+	else if (opts.top_k)
+		print_top_blocks(tops, opts);
+
 	if (total.was_err || was_file_open_err)
 		return BLOCKS_EXIT_HAD_ERROR;
 
@@ -807,6 +2774,44 @@ static void append_file_list(
 	}
 }
 
+// --shard; a file is in the part its middle byte falls in, counting one more
+// byte for each file so empty ones are spread too
+static void take_shard(
+	const prog_options& opts,
+	std::vector<const char *>& file_names
+)
+{
+	if (file_names.empty())
+		errq("shard needs input files");
+
+	std::vector<uint64_t> weights;
+	weights.reserve(file_names.size());
+
+	std::error_code err;
+	uint64_t size = 0;
+	unsigned __int128 total = 0;
+	for (const char * fname : file_names)
+	{
+		if (0 == strcmp(fname, str_stdin))
+			errq("shard cannot be used with stdin");
+
+		size = std::filesystem::file_size(fname, err);
+		weights.push_back((err ? 0 : size) + 1);
+		total += weights.back();
+	}
+
+	size_t shard = opts.shard_index - 1;
+	size_t kept = 0;
+	unsigned __int128 start = 0;
+	for (size_t i = 0, end = file_names.size(); i < end; ++i)
+	{
+		if (((2*start + weights[i]) * opts.shard_count) / (2*total) == shard)
+			file_names[kept++] = file_names[i];
+		start += weights[i];
+	}
+	file_names.resize(kept);
+}
+
 static void append_extra_file_lists(
 	const prog_options& opts,
 	const patterns& pats,
@@ -815,21 +2820,124 @@ static void append_extra_file_lists(
 {
 	append_dir_search(opts, pats, file_names);
 	append_file_list(opts, file_names);
+
+	if (opts.shard_count)
+		take_shard(opts, file_names);
 }
 // </extra_file_lists>
 
-int main(int argc, char * argv[])
+// <serve>
+// --client; the server gets the command line as it was before parsing,
+// without the --client options; those are found by the arguments the parser
+// gave them, so an argument of another option which looks like one stays
+static int run_on_server(
+	const prog_options& opts,
+	int argc,
+	char * argv[],
+	std::vector<std::string>& orig_argv
+)
+{
+	static const char client_eq[] = "--client=";
+	const size_t eq_len = sizeof(client_eq)-1;
+	std::vector<char *> args;
+	bool is_client = false;
+
+	for (int i = 0; i < argc; ++i)
+	{
+		is_client = false;
+		for (const char * arg : opts.client_args)
+		{
+			// --client <socket>, or --client= <socket>
+			if (arg == argv[i])
+			{
+				if (!args.empty())
+					args.pop_back();
+				is_client = true;
+			}
+			// --client=<socket>
+			else if (0 == orig_argv[i].compare(0, eq_len, client_eq)
+				&& arg == argv[i] + eq_len)
+			{
+				is_client = true;
+			}
+		}
+
+		if (!is_client)
+			args.push_back(&orig_argv[i][0]);
+	}
+
+	return serve_client(opts.client_sock, args.size(), args.data());
+}
+// </serve>
+
+static int run(int argc, char * argv[])
 {
 	static prog_options opts;
 	static patterns pats;
 	static std::vector<const char *> file_names;
+	static std::vector<prog_options> queries;
+	std::vector<std::string> orig_argv(argv, argv + argc);
+
+	// a query on a server starts with what the server had
+	opts = prog_options();
+	pats = patterns();
+	file_names.clear();
+	queries.clear();
 
 	handle_options(argc, argv, opts, file_names);
+
+	try
+	{
+		if (opts.serve_sock)
+			serve(opts.serve_sock, run, warm_from_query, BLOCKS_EXIT_HAD_ERROR);
+
+		if (opts.client_sock)
+			return run_on_server(opts, argc, argv, orig_argv);
+	}
+	catch (const std::runtime_error& e)
+	{
+		errq(e.what());
+	}
+
+	if (opts.batch_file)
+		handle_batch_file(opts, queries);
 	make_patterns(opts, pats);
 
 	if (opts.debug)
 		print_debug_and_quit(opts, pats);
 
 	append_extra_file_lists(opts, pats, file_names);
-	return process(opts, pats, file_names);
+
+	// an empty part is not stdin
+	if (opts.shard_count && file_names.empty())
+		return BLOCKS_EXIT_NO_MATCH;
+
+	// the blocks of stdin cannot be read back
+	if (opts.top_k && OUTPUT_OFFSETS != opts.output)
+	{
+		if (file_names.empty())
+			errq("top k cannot be used with stdin, unless with offsets");
+
+		for (const char * fname : file_names)
+		{
+			if (0 == strcmp(fname, str_stdin))
+				errq("top k cannot be used with stdin, unless with offsets");
+		}
+	}
+
+	try
+	{
+		return process(opts, pats, queries, file_names);
+	}
+	catch (const std::runtime_error& e)
+	{
+		errq(e.what());
+	}
+
+	return BLOCKS_EXIT_HAD_ERROR;
+}
+
+int main(int argc, char * argv[])
+{
+	return run(argc, argv);
 }
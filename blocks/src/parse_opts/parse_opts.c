@@ -48,6 +48,9 @@ void opts_parse(int argc, char * argv[], opts_parse_data * parse_data)
     opts_entry * opts_tbl = the_tbl->tbl;
     int opts_tbl_size = the_tbl->length;
 
+    // a '--' ends the options of its own call only
+    g_is_everything_an_arg = false;
+
     for (int i = 0; i < argc; ++i)
     {
         str = argv[i];
@@ -0,0 +1,523 @@
+#include "serve.hpp"
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cerrno>
+#include <climits>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define SERVE_FDS 3
+#define SERVE_MAX_PAYLOAD (64*1024*1024)
+#define SERVE_RECV_TIMEOUT_SEC 5
+
+static const char request_magic[8] = "BLKSRV1";
+
+// followed by the working directory and the arguments, each with its
+// terminator; stdin, stdout, and stderr come with it
+struct request_header
+{
+	char magic[8];
+	uint64_t payload_size;
+};
+
+static std::runtime_error serve_error(const char * what, const char * path)
+{
+	return std::runtime_error(
+		std::string(what).append(" ").append(path).append(": ")
+			.append(strerror(errno))
+	);
+}
+
+static bool read_all(int fd, void * buff, size_t len)
+{
+	char * pos = static_cast<char *>(buff);
+	ssize_t got = 0;
+	while (len)
+	{
+		got = read(fd, pos, len);
+		if (got < 0 && EINTR == errno)
+			continue;
+		if (got <= 0)
+			return false;
+		pos += got;
+		len -= got;
+	}
+	return true;
+}
+
+static bool write_all(int fd, const void * buff, size_t len)
+{
+	const char * pos = static_cast<const char *>(buff);
+	ssize_t put = 0;
+	while (len)
+	{
+		put = write(fd, pos, len);
+		if (put < 0 && EINTR == errno)
+			continue;
+		if (put <= 0)
+			return false;
+		pos += put;
+		len -= put;
+	}
+	return true;
+}
+
+static void make_address(const char * sock_path, sockaddr_un& addr)
+{
+	if (strlen(sock_path) >= sizeof(addr.sun_path))
+	{
+		throw std::runtime_error(
+			std::string("socket path too long: ").append(sock_path)
+		);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, sock_path);
+}
+
+static int connect_to(const char * sock_path)
+{
+	sockaddr_un addr;
+	make_address(sock_path, addr);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		throw serve_error("cannot make socket for", sock_path);
+
+	if (connect(sock, (const sockaddr *)&addr, sizeof(addr)) != 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static bool send_request(int sock, const std::string& payload)
+{
+	request_header hdr;
+	memcpy(hdr.magic, request_magic, sizeof(hdr.magic));
+	hdr.payload_size = payload.size();
+
+	iovec iov = {&hdr, sizeof(hdr)};
+	int fds[SERVE_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+
+	union {
+		char buff[CMSG_SPACE(sizeof(fds))];
+		cmsghdr align;
+	} ctrl;
+	memset(&ctrl, 0, sizeof(ctrl));
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buff;
+	msg.msg_controllen = sizeof(ctrl.buff);
+
+	cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	ssize_t sent = 0;
+	do
+		sent = sendmsg(sock, &msg, 0);
+	while (sent < 0 && EINTR == errno);
+
+	if (sent < 0)
+		return false;
+	if (static_cast<size_t>(sent) < sizeof(hdr)
+		&& !write_all(sock, (char *)&hdr + sent, sizeof(hdr) - sent))
+	{
+		return false;
+	}
+	return write_all(sock, payload.data(), payload.size());
+}
+
+static bool recv_request(int conn, std::string& payload, int * out_fds)
+{
+	request_header hdr;
+	iovec iov = {&hdr, sizeof(hdr)};
+
+	union {
+		char buff[CMSG_SPACE(sizeof(int) * SERVE_FDS)];
+		cmsghdr align;
+	} ctrl;
+
+	msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buff;
+	msg.msg_controllen = sizeof(ctrl.buff);
+
+	ssize_t got = 0;
+	do
+		got = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC);
+	while (got < 0 && EINTR == errno);
+
+	if (got <= 0)
+		return false;
+
+	// whatever came is closed unless it's exactly the fds expected
+	int fd_count = 0;
+	bool is_ok = !(msg.msg_flags & MSG_CTRUNC);
+	for (cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type)
+		{
+			is_ok = false;
+			continue;
+		}
+
+		int fd = -1;
+		size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(fd);
+		for (size_t i = 0; i < count; ++i, ++fd_count)
+		{
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(fd), sizeof(fd));
+			if (fd_count < SERVE_FDS)
+				out_fds[fd_count] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	if (!is_ok || fd_count != SERVE_FDS)
+	{
+		for (int i = 0; i < fd_count && i < SERVE_FDS; ++i)
+		{
+			close(out_fds[i]);
+			out_fds[i] = -1;
+		}
+		return false;
+	}
+
+	if (static_cast<size_t>(got) < sizeof(hdr)
+		&& !read_all(conn, (char *)&hdr + got, sizeof(hdr) - got))
+	{
+		return false;
+	}
+
+	if (memcmp(hdr.magic, request_magic, sizeof(hdr.magic)) != 0
+		|| hdr.payload_size > SERVE_MAX_PAYLOAD)
+	{
+		return false;
+	}
+
+	payload.resize(hdr.payload_size);
+	return read_all(conn, &payload[0], payload.size());
+}
+
+// a query being run, in a copy of the server
+struct query
+{
+	pid_t pid;
+	int conn;
+	int report; // what the query sends with serve_report()
+	std::string reports;
+};
+
+// the write end of the report pipe in a query; -1 in the server and outside
+static int report_fd = -1;
+
+bool serve_report(const void * rec, size_t len)
+{
+	if (report_fd < 0 || len > SERVE_MAX_PAYLOAD)
+		return false;
+
+	uint32_t len32 = static_cast<uint32_t>(len);
+	return (write_all(report_fd, &len32, sizeof(len32))
+		&& write_all(report_fd, rec, len));
+}
+
+// only the user the server runs as gets its queries run
+static bool is_own_user(int conn)
+{
+	ucred cred;
+	socklen_t len = sizeof(cred);
+	return (0 == getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len)
+		&& sizeof(cred) == len && getuid() == cred.uid);
+}
+
+// in the copy of the server made for the query; the request is read here, so
+// a slow client holds up no one else
+static void run_query(int conn, serve_run_fn run, int err_status)
+{
+	std::string payload;
+	int fds[SERVE_FDS] = {-1, -1, -1};
+	std::vector<char *> argv;
+
+	// the whole request, not each read of it
+	alarm(SERVE_RECV_TIMEOUT_SEC);
+	bool is_ok = (recv_request(conn, payload, fds)
+		&& !payload.empty() && payload.back() == '\0');
+	alarm(0);
+
+	// the working directory, then argv
+	const char * cwd = payload.c_str();
+	for (size_t i = strlen(cwd)+1, end = payload.size(); is_ok && i < end;
+		i += strlen(&payload[i])+1)
+	{
+		argv.push_back(&payload[i]);
+	}
+	argv.push_back(nullptr);
+
+	if (!is_ok || argv.size() < 2)
+		exit(err_status);
+
+	for (int i = 0; i < SERVE_FDS; ++i)
+	{
+		dup2(fds[i], i);
+		if (fds[i] >= SERVE_FDS)
+			close(fds[i]);
+	}
+	close(conn);
+
+	if (chdir(cwd) != 0)
+	{
+		fprintf(stderr, "%s: error: cannot change directory to %s: %s\n",
+			argv[0], cwd, strerror(errno));
+		exit(err_status);
+	}
+
+	exit(run(argv.size()-1, argv.data()));
+}
+
+// false if the query can't be started; the client's connection is left to
+// the caller then
+static bool start_query(
+	int sock,
+	int conn,
+	const std::vector<query>& running,
+	serve_run_fn run,
+	int err_status,
+	query& out
+)
+{
+	int pipe_fds[2] = {-1, -1};
+	if (pipe2(pipe_fds, O_CLOEXEC) != 0)
+		return false;
+
+	pid_t pid = fork();
+	if (0 == pid)
+	{
+		close(sock);
+		for (const auto& other : running)
+		{
+			close(other.conn);
+			close(other.report);
+		}
+
+		close(pipe_fds[0]);
+		report_fd = pipe_fds[1];
+		signal(SIGPIPE, SIG_DFL);
+
+		run_query(conn, run, err_status);
+	}
+
+	close(pipe_fds[1]);
+	if (pid < 0)
+	{
+		close(pipe_fds[0]);
+		return false;
+	}
+
+	out.pid = pid;
+	out.conn = conn;
+	out.report = pipe_fds[0];
+	out.reports.clear();
+	return true;
+}
+
+// false once the query is done, when its end of the pipe is closed
+static bool read_reports(query& qry)
+{
+	static char buff[4096];
+
+	ssize_t got = read(qry.report, buff, sizeof(buff));
+	if (got < 0)
+		return (EINTR == errno || EAGAIN == errno);
+	if (0 == got)
+		return false;
+
+	qry.reports.append(buff, got);
+	return true;
+}
+
+// sends the client the exit status of its query, then makes what the query
+// reported
+static void end_query(query& qry, serve_warm_fn warm, int err_status)
+{
+	int32_t status = err_status;
+	int wstatus = 0;
+	pid_t pid = 0;
+
+	while ((pid = waitpid(qry.pid, &wstatus, 0)) < 0 && EINTR == errno)
+		continue;
+
+	if (pid > 0)
+	{
+		if (WIFEXITED(wstatus))
+			status = WEXITSTATUS(wstatus);
+		else if (WIFSIGNALED(wstatus))
+			status = 128 + WTERMSIG(wstatus);
+	}
+
+	write_all(qry.conn, &status, sizeof(status));
+	close(qry.conn);
+	close(qry.report);
+
+	// a record cut short by a query which died is left out
+	uint32_t len = 0;
+	const std::string& recs = qry.reports;
+	for (size_t pos = 0, end = recs.size(); end - pos >= sizeof(len);
+		pos += len)
+	{
+		memcpy(&len, &recs[pos], sizeof(len));
+		pos += sizeof(len);
+		if (len > end - pos)
+			break;
+
+		if (warm)
+			warm(&recs[pos], len);
+	}
+}
+
+void serve(
+	const char * sock_path,
+	serve_run_fn run,
+	serve_warm_fn warm,
+	int err_status
+)
+{
+	int sock = connect_to(sock_path);
+	if (sock >= 0)
+	{
+		close(sock);
+		throw std::runtime_error(
+			std::string("already being served: ").append(sock_path)
+		);
+	}
+
+	// made aside and renamed over what's left from a server which is gone,
+	// so a client never finds the socket before it's listened on
+	std::string tmp_path(sock_path);
+	tmp_path.append(".tmp").append(std::to_string(getpid()));
+
+	sockaddr_un addr;
+	make_address(tmp_path.c_str(), addr);
+
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		throw serve_error("cannot make socket for", sock_path);
+
+	unlink(tmp_path.c_str());
+	if (bind(sock, (const sockaddr *)&addr, sizeof(addr)) != 0
+		|| listen(sock, SOMAXCONN) != 0
+		|| rename(tmp_path.c_str(), sock_path) != 0)
+	{
+		int err = errno;
+		close(sock);
+		unlink(tmp_path.c_str());
+		errno = err;
+		throw serve_error("cannot listen on", sock_path);
+	}
+
+	// a client gone before its status is sent doesn't end the server
+	signal(SIGPIPE, SIG_IGN);
+
+	std::vector<query> running;
+	std::vector<pollfd> polls;
+	query qry;
+	int conn = -1;
+
+	while (true)
+	{
+		polls.clear();
+		polls.push_back({sock, POLLIN, 0});
+		for (const auto& other : running)
+			polls.push_back({other.report, POLLIN, 0});
+
+		if (poll(polls.data(), polls.size(), -1) < 0)
+		{
+			if (EINTR == errno)
+				continue;
+			throw serve_error("cannot wait on", sock_path);
+		}
+
+		// from the back, so what's left keeps its place
+		for (size_t i = running.size(); i > 0; --i)
+		{
+			if (polls[i].revents && !read_reports(running[i-1]))
+			{
+				end_query(running[i-1], warm, err_status);
+				running.erase(running.begin() + (i-1));
+			}
+		}
+
+		if (!(polls[0].revents & POLLIN))
+			continue;
+
+		conn = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+		if (conn < 0)
+		{
+			if (EINTR == errno || ECONNABORTED == errno || EAGAIN == errno)
+				continue;
+			throw serve_error("cannot accept on", sock_path);
+		}
+
+		if (!is_own_user(conn))
+			close(conn);
+		else if (start_query(sock, conn, running, run, err_status, qry))
+			running.push_back(qry);
+		else
+			close(conn);
+	}
+}
+
+int serve_client(const char * sock_path, int argc, char * argv[])
+{
+	int sock = connect_to(sock_path);
+	if (sock < 0)
+		throw serve_error("cannot connect to", sock_path);
+
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+	{
+		close(sock);
+		throw serve_error("cannot get working directory for", sock_path);
+	}
+
+	std::string payload(cwd);
+	payload.push_back('\0');
+	for (int i = 0; i < argc; ++i)
+		payload.append(argv[i]).push_back('\0');
+
+	int32_t status = 0;
+	bool ok = (send_request(sock, payload)
+		&& read_all(sock, &status, sizeof(status)));
+	int err = errno;
+	close(sock);
+
+	if (!ok)
+	{
+		errno = err ? err : ECONNRESET;
+		throw serve_error("lost connection to", sock_path);
+	}
+	return status;
+}
@@ -0,0 +1,35 @@
+#ifndef SERVE_HPP
+#define SERVE_HPP
+
+#include <cstddef>
+
+// A server on a local socket which runs queries for clients. A client sends
+// its working directory, its arguments, and its standard input, output, and
+// error; the server runs the query with them in a copy of itself, so the
+// output goes straight to the client's, and sends back the exit status.
+// Queries run side by side. What a query made which the ones after it can use
+// is sent to the server with serve_report() and given to the warm function
+// once the query is done, so the server can make it too and every later copy
+// starts with it. Only clients of the user the server runs as are served.
+typedef int (*serve_run_fn)(int argc, char * argv[]);
+typedef void (*serve_warm_fn)(const char * rec, size_t len);
+
+// never returns; a query which can't be started exits with err_status; throws
+// std::runtime_error if the socket can't be made or if another server is
+// already on it
+void serve(
+	const char * sock_path,
+	serve_run_fn run,
+	serve_warm_fn warm,
+	int err_status
+);
+
+// in a query run by a server, sends rec to it; false and nothing is sent
+// anywhere else
+bool serve_report(const void * rec, size_t len);
+
+// runs argv on the server at sock_path and returns its exit status; throws
+// std::runtime_error if the server can't be reached
+int serve_client(const char * sock_path, int argc, char * argv[]);
+
+#endif
@@ -1,7 +1,10 @@
 #include "matcher.hpp"
 #include "lexer.hpp"
+#include "xml_lexer.hpp"
+#include "c_lexer.hpp"
 #include "block_parser.hpp"
 #include "find_files.hpp"
+#include "libblocks.hpp"
 
 #include <memory>
 #include <string>
@@ -26,6 +29,9 @@ static bool test_block_comment();
 static bool test_closest_name_to_block_open();
 static bool test_no_strings();
 static bool test_file_finder();
+static bool test_xml_lexer();
+static bool test_c_lexer();
+static bool test_libblocks();
 
 static ftest tests[] = {
 	test_matchers,
@@ -35,7 +41,10 @@ static ftest tests[] = {
 	test_block_comment,
 	test_closest_name_to_block_open,
 	test_no_strings,
-	test_file_finder
+	test_file_finder,
+	test_xml_lexer,
+	test_c_lexer,
+	test_libblocks
 };
 
 static bool test_matchers()
@@ -291,10 +300,10 @@ static bool test_lexer_tests_trivial_multiline_comment(
 			check(lex.line_pos() == 7);
 			check(lex.line_num() == 1);
 
-			// match main // {
+			// the line was tokenized once; the rest of it is still a comment
 			check(lex.block_name() == lexer::tok::NONE);
-			check(lex.block_open_close() == lexer::tok::OPEN);
-			check(lex.line_pos() == 8);
+			check(lex.block_open_close() == lexer::tok::NONE);
+			check(lex.line_pos() == 7);
 			check(lex.line_num() == 1);
 
 			// next line
@@ -346,10 +355,10 @@ static bool test_lexer_tests_trivial_multiline_comment(
 			check(lex.line_pos() == 2);
 			check(lex.line_num() == 5);
 
-			// match name
-			check(lex.block_name() == lexer::tok::NAME);
+			// the name is inside the comment
+			check(lex.block_name() == lexer::tok::NONE);
 			check(lex.block_open_close() == lexer::tok::NONE);
-			check(lex.line_pos() == 7);
+			check(lex.line_pos() == 2);
 			check(lex.line_num() == 5);
 
 			// next line
@@ -1015,10 +1024,523 @@ static bool test_block_parser_icase()
 	return true;
 }
 
+static bool test_block_parser_long_lines()
+{
+	// lines bigger than an arena chunk, text has to survive the chunk growth
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name, sm_open, sm_close;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	sm_open.reset(mfact.create(matcher::type::STRING, "{"));
+	sm_close.reset(mfact.create(matcher::type::STRING, "}"));
+
+	const std::string lines[] = {
+		"main {",                 // 0
+		std::string(3000, 'a'),   // 1
+		std::string(5000, 'b'),   // 2
+		std::string(20000, 'c'),  // 3
+		"}",                      // 4
+		"main {",                 // 5
+		std::string(9000, 'd'),   // 6
+		"}",                      // 7
+	};
+
+	std::stringstream isstrm;
+	const std::string input(cat(lines, ARR_SIZE(lines)));
+
+	lexer::matchers pats(sm_name.get(), sm_open.get(), sm_close.get());
+	lexer lex(isstrm, pats);
+	block_parser pars(lex);
+
+	// the arena is kept between files
+	for (int i = 0; i < 2; ++i)
+	{
+		isstrm.str(input);
+		pars.init("n/a");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+
+		auto block = pars.get_block();
+		check(block.size() == 5);
+		for (size_t j = 0; j < 5; ++j)
+		{
+			check(lines[j] == block[j].get_line());
+			check(lines[j].length() == block[j].get_line_len());
+		}
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+
+		block = pars.get_block();
+		check(block.size() == 3);
+		for (size_t j = 0; j < 3; ++j)
+			check(lines[j+5] == block[j].get_line());
+
+		check(!pars.parse_block());
+	}
+
+	return true;
+}
+
+static bool test_block_parser_sink()
+{
+	class cls_test_sink : public block_parser::line_sink
+	{
+	public:
+		cls_test_sink(block_parser::line_mode mode) :
+			m_mode(mode), m_head(0), m_ends(0), m_errors(0)
+		{}
+
+		block_parser::line_mode block_start(
+			const std::vector<block_parser::block_line>& head
+		) override
+		{
+			m_head = head.size();
+			m_lines.clear();
+			return m_mode;
+		}
+
+		block_parser::line_mode block_line_done(
+			const block_parser::block_line& line
+		) override
+		{
+			m_lines.push_back(line.get_line());
+			return m_mode;
+		}
+
+		void block_end(const block_parser::block_line * last) override
+		{
+			if (last)
+			{
+				m_lines.push_back(last->get_line());
+				++m_ends;
+			}
+			else
+			{
+				++m_errors;
+			}
+		}
+
+		block_parser::line_mode m_mode;
+		std::vector<std::string> m_lines;
+		size_t m_head;
+		size_t m_ends;
+		size_t m_errors;
+	};
+
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name, sm_open, sm_close;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	sm_open.reset(mfact.create(matcher::type::STRING, "{"));
+	sm_close.reset(mfact.create(matcher::type::STRING, "}"));
+
+	const std::string lines[] = {
+		"main",      // 0
+		"",          // 1
+		"{ foo",     // 2
+		"bar {",     // 3
+		"}",         // 4
+		"} main {",  // 5
+		"baz",       // 6
+	};
+
+	std::stringstream isstrm;
+	const std::string input(cat(lines, ARR_SIZE(lines)));
+	lexer::matchers pats(sm_name.get(), sm_open.get(), sm_close.get());
+
+	/*** streamed lines are dropped by the parser ***/
+	{
+		lexer lex(isstrm, pats);
+		block_parser pars(lex);
+		cls_test_sink sink(block_parser::LM_STREAM);
+
+		isstrm.str(input);
+		pars.set_sink(&sink);
+		pars.init("n/a");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(3 == sink.m_head);
+		check(1 == sink.m_ends);
+		check(6 == sink.m_lines.size());
+		for (size_t i = 0; i < 6; ++i)
+			check(lines[i] == sink.m_lines[i]);
+
+		// only the last line is kept
+		check(1 == pars.get_block().size());
+		check(lines[5] == pars.get_block()[0].get_line());
+
+		// open with no close
+		check(pars.parse_block());
+		check(pars.had_error());
+		check(1 == sink.m_head);
+		check(1 == sink.m_errors);
+		check(1 == sink.m_lines.size());
+		check(lines[5] == sink.m_lines[0]);
+		check(std::string("n/a:7:1: improper nesting from line 6")
+			== pars.get_error_report()[0]);
+
+		check(!pars.parse_block());
+	}
+
+	/*** stored lines are seen and kept ***/
+	{
+		lexer lex(isstrm, pats);
+		block_parser pars(lex);
+		cls_test_sink sink(block_parser::LM_STORE);
+
+		isstrm.str(input);
+		pars.set_sink(&sink);
+		pars.init("n/a");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(6 == sink.m_lines.size());
+		check(6 == pars.get_block().size());
+	}
+
+	/*** skipped lines are not seen ***/
+	{
+		lexer lex(isstrm, pats);
+		block_parser pars(lex);
+		cls_test_sink sink(block_parser::LM_SKIP);
+
+		isstrm.str(input);
+		pars.set_sink(&sink);
+		pars.init("n/a");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(1 == sink.m_ends);
+		check(1 == sink.m_lines.size());
+		check(lines[5] == sink.m_lines[0]);
+		check(1 == pars.get_block().size());
+
+		check(pars.parse_block());
+		check(pars.had_error());
+		check(std::string("n/a:7:1: improper nesting from line 6")
+			== pars.get_error_report()[0]);
+	}
+
+	/*** stored lines spill to disk ***/
+	{
+		class cls_test_visitor : public block_parser::line_visitor
+		{
+		public:
+			void visit(
+				const block_parser::block_line& line,
+				bool is_last
+			) override
+			{
+				m_lines.push_back(line.get_line());
+				m_nums.push_back(line.get_line_no());
+				m_opens.push_back(line.has_token(lexer::tok::OPEN));
+				m_last = is_last;
+			}
+
+			std::vector<std::string> m_lines;
+			std::vector<size_t> m_nums;
+			std::vector<bool> m_opens;
+			bool m_last = false;
+		};
+
+		lexer lex(isstrm, pats);
+		block_parser pars(lex);
+		cls_test_sink sink(block_parser::LM_STORE);
+
+		isstrm.str(input);
+		pars.set_sink(&sink);
+		pars.set_max_block_memory(1);
+		pars.init("n/a");
+
+		// do more than once, the spill file is reused
+		for (int i = 0; i < 2; ++i)
+		{
+			if (i)
+			{
+				isstrm.str(input);
+				pars.init("n/a");
+			}
+
+			check(pars.parse_block());
+			check(!pars.had_error());
+			check(pars.get_block().size() < 6);
+
+			cls_test_visitor vis;
+			pars.visit_block(vis);
+			check(vis.m_last);
+			check(6 == vis.m_lines.size());
+			for (size_t j = 0; j < 6; ++j)
+			{
+				check(lines[j] == vis.m_lines[j]);
+				check(j+1 == vis.m_nums[j]);
+			}
+			check(!vis.m_opens[1]);
+			check(vis.m_opens[2]);
+			check(vis.m_opens[3]);
+		}
+	}
+
+	return true;
+}
+
+// the block from its name to its close, as --sub-line prints it
+static std::string sub_line_text(
+	const std::vector<block_parser::block_line>& block
+)
+{
+	std::string ret("");
+	for (size_t i = 0, end = block.size(); i < end; ++i)
+	{
+		const auto& line = block[i];
+		ret.append(line.get_line() + line.get_begin(),
+			line.get_end() - line.get_begin());
+
+		if (i < end-1 && !line.continues())
+			ret += '\n';
+	}
+	return ret;
+}
+
+static bool test_block_parser_sub_line()
+{
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name, sm_open, sm_close;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	sm_open.reset(mfact.create(matcher::type::STRING, "{"));
+	sm_close.reset(mfact.create(matcher::type::STRING, "}"));
+
+	const std::string lines[] = {
+		"x main { a; b } y main {c}", // 1
+		"main { d",                   // 2
+		"}",                          // 3
+		"main { e } main }",          // 4
+	};
+
+	std::stringstream isstrm;
+	const std::string input(cat(lines, ARR_SIZE(lines)));
+
+	lexer::matchers pats(sm_name.get(), sm_open.get(), sm_close.get());
+	lexer lex(isstrm, pats);
+	block_parser pars(lex);
+
+	// the same blocks wherever the lines are cut, names and strings longer
+	// than a piece aside
+	for (size_t max : {4, 5, 7, 64})
+	{
+		isstrm.clear();
+		isstrm.str(input);
+		lex.set_piece_max(max);
+		pars.init("n/a");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(sub_line_text(pars.get_block()) == "main { a; b }");
+		check(pars.get_block().front().get_line_no() == 1);
+		check(pars.get_block().back().get_line_no() == 1);
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(sub_line_text(pars.get_block()) == "main {c}");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(sub_line_text(pars.get_block()) == "main { d\n}");
+		check(pars.get_block().front().get_line_no() == 2);
+		check(pars.get_block().back().get_line_no() == 3);
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(sub_line_text(pars.get_block()) == "main { e }");
+
+		// the column counts from the start of the line, not of the piece
+		check(pars.parse_block());
+		check(pars.had_error());
+		check(pars.get_error_report()[0]
+			== "n/a:4:17: improper nesting from line 4");
+
+		check(!pars.parse_block());
+	}
+
+	return true;
+}
+
+static bool test_block_parser_span()
+{
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name, sm_open, sm_close;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	sm_open.reset(mfact.create(matcher::type::STRING, "{"));
+	sm_close.reset(mfact.create(matcher::type::STRING, "}"));
+
+	const std::string lines[] = {
+		"x main { { } y } main",      // 1
+		"{",                          // 2
+		"}",                          // 3
+	};
+
+	std::stringstream isstrm;
+	const std::string input(cat(lines, ARR_SIZE(lines)));
+
+	lexer::matchers pats(sm_name.get(), sm_open.get(), sm_close.get());
+	lexer lex(isstrm, pats);
+	block_parser pars(lex);
+
+	// the same bytes wherever the lines are cut
+	for (size_t max : {4, 64})
+	{
+		isstrm.clear();
+		isstrm.str(input);
+		lex.set_piece_max(max);
+		pars.init("n/a");
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(pars.get_span().name_byte == 2);
+		check(pars.get_span().name_end_byte == 6);
+		check(pars.get_name() == "main");
+		check(pars.get_span().open_byte == 7);
+		check(pars.get_span().close_end_byte == 16);
+		check(pars.get_span().first_line == 1);
+		check(pars.get_span().last_line == 1);
+		check(pars.get_span().depth == 1);
+
+		check(pars.parse_block());
+		check(!pars.had_error());
+		check(pars.get_span().name_byte == 17);
+		check(pars.get_span().name_end_byte == 21);
+		check(pars.get_name() == "main");
+		check(pars.get_span().open_byte == 22);
+		check(pars.get_span().close_end_byte == 25);
+		check(pars.get_span().first_line == 1);
+		check(pars.get_span().last_line == 3);
+		check(pars.get_span().depth == 0);
+
+		check(!pars.parse_block());
+	}
+
+	return true;
+}
+
+static bool test_block_parser_resume()
+{
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name, sm_open, sm_close;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	sm_open.reset(mfact.create(matcher::type::STRING, "{"));
+	sm_close.reset(mfact.create(matcher::type::STRING, "}"));
+
+	const std::string lines[] = {
+		"main {",                     // 1
+		"} main { x",                 // 2
+		"}",                          // 3
+		"main {",                     // 4
+	};
+
+	std::stringstream isstrm;
+	const std::string input(cat(lines, ARR_SIZE(lines)));
+
+	lexer::matchers pats(sm_name.get(), sm_open.get(), sm_close.get());
+	lexer lex(isstrm, pats);
+	block_parser pars(lex);
+
+	isstrm.str(input);
+	pars.init("n/a");
+	check(pars.get_resume_byte() == 0);
+	check(pars.get_resume_line() == 1);
+
+	check(pars.parse_block());
+	check(pars.get_resume_byte() == 8);
+	check(pars.get_resume_line() == 2);
+	check(pars.parse_block());
+	check(pars.get_resume_byte() == 19);
+	check(pars.get_resume_line() == 3);
+
+	// the open block at the end doesn't move it
+	check(pars.parse_block());
+	check(pars.had_error());
+	check(pars.get_resume_byte() == 19);
+
+	// the same from there on, with the lines and bytes of the whole input
+	isstrm.clear();
+	isstrm.str(input.substr(8));
+	lex.set_start(1, 8);
+	pars.init("n/a");
+	check(pars.get_resume_byte() == 8);
+	check(pars.get_resume_line() == 2);
+
+	check(pars.parse_block());
+	check(pars.get_span().name_byte == 9);
+	check(pars.get_span().first_line == 2);
+	check(pars.get_resume_byte() == 19);
+	check(pars.get_resume_line() == 3);
+
+	return true;
+}
+
+static bool test_block_parser_range()
+{
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name, sm_open, sm_close;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	sm_open.reset(mfact.create(matcher::type::STRING, "{"));
+	sm_close.reset(mfact.create(matcher::type::STRING, "}"));
+
+	const std::string lines[] = {
+		"main {",                     // 1
+		"main { }",                   // 2
+		"}",                          // 3
+		"main { main {",              // 4
+		"} }",                        // 5
+		"main {",                     // 6
+	};
+
+	std::stringstream isstrm;
+	lexer::matchers pats(sm_name.get(), sm_open.get(), sm_close.get());
+	lexer lex(isstrm, pats);
+	block_parser pars(lex);
+
+	// the block on line 2 is inside the one before the range
+	isstrm.str(cat(lines, ARR_SIZE(lines)));
+	pars.set_range(block_parser::name_range{1, SIZE_MAX, 2, 5});
+	pars.init("n/a");
+	check(pars.parse_block());
+	check(!pars.had_error());
+	check(pars.get_span().first_line == 4);
+	check(pars.get_span().last_line == 5);
+
+	// the open block after the range is not reported
+	check(!pars.parse_block());
+
+	// a block may go on past the end
+	isstrm.clear();
+	isstrm.str(cat(lines, ARR_SIZE(lines)));
+	pars.set_range(block_parser::name_range{0, 1, 0, SIZE_MAX});
+	pars.init("n/a");
+	check(pars.parse_block());
+	check(pars.get_span().name_byte == 0);
+	check(pars.get_span().last_line == 3);
+	check(!pars.parse_block());
+
+	return true;
+}
+
 static bool test_block_parser()
 {
 	check(test_block_parser_blocks());
 	check(test_block_parser_icase());
+	check(test_block_parser_long_lines());
+	check(test_block_parser_sink());
+	check(test_block_parser_sub_line());
+	check(test_block_parser_resume());
+	check(test_block_parser_range());
+	check(test_block_parser_span());
 	return true;
 }
 
@@ -1976,6 +2498,279 @@ static bool test_file_finder()
 	return true;
 }
 
+static bool test_xml_lexer()
+{
+	/*** any tag ***/
+	{
+		const std::string input(
+			"<?xml version=\"1.0\"?>\n"
+			"<a x='</a>'><b/><c>\n"
+			"<!-- <d> --></c><![CDATA[<e>]]>\n"
+			"<f\n"
+			"  y=\">\"/>\n"
+			"</a>\n"
+		);
+		std::stringstream isstrm;
+		lexer::matchers pats;
+		xml_lexer lex(isstrm, pats);
+
+		for (int i = 0; i < 2; ++i)
+		{
+			isstrm.str(input);
+			lex.reset();
+
+			// processing instruction
+			check(lex.line_num() == 1);
+			check(lex.block_name_open_close() == lexer::tok::NONE);
+
+			// <a, quoted attribute, self-closing <b/>, <c
+			check(lex.next_line());
+			check(lex.block_name() == lexer::tok::NAME);
+			check(lex.line_pos() == 0);
+			check(lex.also_matches_open());
+			check(lex.block_open_close() == lexer::tok::OPEN);
+			lex.advance_past_match();
+			check(lex.line_pos() == 2);
+			check(lex.block_open_close() == lexer::tok::OPEN);
+			check(lex.line_pos() == 16);
+			lex.advance_past_match();
+			check(lex.block_name_open_close() == lexer::tok::NONE);
+
+			// comment, </c, cdata
+			check(lex.next_line());
+			check(lex.block_open_close() == lexer::tok::CLOSE);
+			check(lex.line_pos() == 12);
+			lex.advance_past_match();
+			check(lex.block_name_open_close() == lexer::tok::NONE);
+
+			// self-closing <f over two lines
+			check(lex.next_line());
+			check(lex.block_name_open_close() == lexer::tok::NONE);
+			check(lex.next_line());
+			check(lex.line_num() == 5);
+			check(lex.block_name_open_close() == lexer::tok::NONE);
+
+			// </a>; the close takes in the '>'
+			check(lex.next_line());
+			check(lex.block_open_close() == lexer::tok::CLOSE);
+			check(lex.line_pos() == 0);
+			lex.advance_past_match();
+			check(lex.line_pos() == 4);
+
+			check(!lex.next_line());
+			check(lex.block_name_open_close() == lexer::tok::EOI);
+		}
+	}
+
+	/*** named tags ***/
+	{
+		const std::string input("<tomato><to>x</to></tomato><TO></TO>");
+		std::stringstream isstrm;
+		matcher_factory mfact;
+
+		std::unique_ptr<matcher> rm_name;
+		rm_name.reset(mfact.create(matcher::type::REGEX, "^(to)$"));
+		lexer::matchers pats(rm_name.get());
+		xml_lexer lex(isstrm, pats);
+
+		isstrm.str(input);
+		lex.reset();
+
+		check(lex.block_name() == lexer::tok::NAME);
+		check(lex.line_pos() == 8);
+		lex.advance_past_match();
+		check(lex.block_open_close() == lexer::tok::CLOSE);
+		check(lex.line_pos() == 13);
+		lex.advance_past_match();
+		check(lex.block_name_open_close() == lexer::tok::NONE);
+	}
+
+	return true;
+}
+
+static bool test_c_lexer()
+{
+	const std::string input(
+		"#define X { \\\n"
+		"  }\n"
+		"main() { '{'; 1'0; \"}\\\n"
+		"\"; R\"d(})d\" }\n"
+		"/* main { */ main\n"
+	);
+	std::stringstream isstrm;
+	matcher_factory mfact;
+
+	std::unique_ptr<matcher> sm_name;
+	sm_name.reset(mfact.create(matcher::type::STRING, "main"));
+	lexer::matchers pats(sm_name.get());
+	c_lexer lex(isstrm, pats);
+
+	for (int i = 0; i < 2; ++i)
+	{
+		isstrm.str(input);
+		lex.reset();
+
+		// directive and its continuation
+		check(lex.block_name_open_close() == lexer::tok::NONE);
+		check(lex.next_line());
+		check(lex.block_name_open_close() == lexer::tok::NONE);
+
+		// name, open, the rest is a char, a number, and a continued string
+		check(lex.next_line());
+		check(lex.block_name_open_close() == lexer::tok::NAME);
+		check(lex.line_pos() == 0);
+		lex.advance_past_match();
+		check(lex.block_name_open_close() == lexer::tok::OPEN);
+		check(lex.line_pos() == 7);
+		lex.advance_past_match();
+		check(lex.block_name_open_close() == lexer::tok::NONE);
+
+		// end of the string, raw string, close
+		check(lex.next_line());
+		check(lex.block_open_close() == lexer::tok::CLOSE);
+		check(lex.line_pos() == 12);
+		lex.advance_past_match();
+		check(lex.block_name_open_close() == lexer::tok::NONE);
+
+		// name after a block comment
+		check(lex.next_line());
+		check(lex.block_name_open_close() == lexer::tok::NAME);
+		check(lex.line_pos() == 13);
+
+		check(!lex.next_line());
+		check(lex.block_name_open_close() == lexer::tok::EOI);
+	}
+
+	return true;
+}
+
+class collect_lines : public block_parser::line_visitor
+{
+public:
+	void visit(const block_parser::block_line& line, bool is_last) override
+	{
+		text.append(line.get_line() + line.get_begin(),
+			line.get_end() - line.get_begin());
+		if (!is_last)
+			text.append("\n");
+	}
+
+	std::string text;
+};
+
+static bool test_libblocks()
+{
+	const std::string lines[] = {
+		"foo {",                      // 1
+		"  bar",                      // 2
+		"}",                          // 3
+		"baz {",                      // 4
+		"  qux",                      // 5
+		"}",                          // 6
+		"foo { bar }",                // 7
+	};
+	const std::string input(cat(lines, ARR_SIZE(lines)));
+
+	struct found
+	{
+		std::string name;
+		size_t first_line;
+		size_t last_line;
+		size_t name_byte;
+		size_t close_end_byte;
+		std::string text;
+	};
+	std::vector<found> out;
+
+	blocks_finder::callback keep = [&out](const blocks_view& view)
+	{
+		collect_lines lines;
+		view.visit(lines);
+		out.push_back({
+			view.name(),
+			view.span().first_line,
+			view.span().last_line,
+			view.span().name_byte,
+			view.span().close_end_byte,
+			lines.text
+		});
+		return true;
+	};
+
+	blocks_config cfg;
+	cfg.name = blocks_pattern("^[a-z]+", true);
+	cfg.match.push_back(blocks_pattern("BAR", false, true));
+
+	{
+		blocks_finder finder(cfg);
+		check(finder.find(input.data(), input.size(), "buff", keep));
+		check(finder.get_error_report().empty());
+
+		check(out.size() == 2);
+		check(out[0].name == "buff");
+		check(out[0].first_line == 1);
+		check(out[0].last_line == 3);
+		check(out[0].name_byte == 0);
+		check(out[0].close_end_byte == 13);
+		check(out[0].text == "foo {\n  bar\n}");
+		check(out[1].first_line == 7);
+		check(out[1].last_line == 7);
+		check(out[1].name_byte == 28);
+		check(out[1].text == "foo { bar }");
+
+		// the same from a stream, and the callback can stop it
+		out.clear();
+		std::stringstream isstrm(input);
+		check(finder.find(isstrm, "strm",
+			[&out, &keep](const blocks_view& view)
+			{keep(view); return false;}
+		));
+		check(out.size() == 1);
+		check(out[0].name == "strm");
+		check(out[0].first_line == 1);
+	}
+
+	// and/or of the predicates
+	cfg.dont_match.push_back(blocks_pattern(" }"));
+	{
+		out.clear();
+		blocks_finder finder(cfg);
+		check(finder.find(input.data(), input.size(), "buff", keep));
+		check(out.size() == 1);
+		check(out[0].first_line == 1);
+
+		out.clear();
+		cfg.and_mM_together = false;
+		blocks_finder finder_or(cfg);
+		check(finder_or.find(input.data(), input.size(), "buff", keep));
+		check(out.size() == 3);
+		check(out[1].first_line == 4);
+	}
+
+	// nesting errors are reported, not printed
+	{
+		out.clear();
+		const std::string bad("foo {\n{\n");
+		blocks_finder finder(blocks_config{});
+		check(!finder.find(bad.data(), bad.size(), "bad", keep));
+		check(!finder.get_error_report().empty());
+		check(out.empty());
+
+		bool threw = false;
+		try
+		{
+			finder.find("./no/such/file", keep);
+		}
+		catch (const std::runtime_error& e)
+		{
+			threw = true;
+		}
+		check(threw);
+	}
+
+	return true;
+}
+
 // <impl>
 bool check_(bool expr_val, cpstr expr_ch, cpstr file, cpstr func, size_t line)
 {
@@ -108,6 +108,14 @@ function test_block_name
 	# match 2; regex
 	run_ok "-r -n 'main|foo' $G_TEST_FILE_1"
 	diff_stdout "block_name_match_2_regex.txt"
+
+	# '^' matches where the parser is, e.g. after a '}'
+	local L_FILE="./input/test_input_anchored.txt"
+	run_ok "-r -n '^[a-z]+' $L_FILE"
+	diff_stdout "block_name_anchored.txt"
+
+	run_ok "-r -n '[a-z]' -s '^ \{' -e '\}' $L_FILE"
+	diff_stdout "block_name_anchored.txt"
 }
 
 function test_block_start_end
@@ -202,6 +210,25 @@ function test_match_dont_match_single
 	run_ok "-n 'max' -m 'the quick' $G_TEST_FILE_1"
 	diff_stdout "block_match_name.txt"
 
+	# blocks spilled to disk print the same
+	run_ok "-m 'the quick' --max-block-memory 1 $G_TEST_FILE_1"
+	diff_stdout "block_match_default.txt"
+
+	run_ok "-n 'max' -m 'the quick' --max-block-memory 1K $G_TEST_FILE_1"
+	diff_stdout "block_match_name.txt"
+
+	# a size is a number and at most one unit, and has to fit
+	run "--max-block-memory 10KB $G_TEST_FILE_1"
+	assert_ec 2
+	run "--max-block-memory 5Mfoo $G_TEST_FILE_1"
+	assert_ec 2
+	run "--max-block-memory '1 G' $G_TEST_FILE_1"
+	assert_ec 2
+	run "--max-block-memory 99999999999999999999 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--max-block-memory 18014398509481984K $G_TEST_FILE_1"
+	assert_ec 2
+
 	# don't match
 	run_nok "-n 'max' -M 'the quick' $G_TEST_FILE_1"
 	diff_stdout "empty"
@@ -314,6 +341,12 @@ function test_block_count
 
 	run_ok "-c 5 $G_TEST_FILE_1 -C '//' -B '/*' -T '*/'"
 	diff_stdout "blocks_count_4.txt"
+
+	# reading stops once the count is used up; the input never ends
+	set_run_prefix "(echo 'one { }'; yes '{') |"
+	run_ok "-c 1"
+	diff_stdout "blocks_count_stdin.txt"
+	unset_run_prefix
 }
 
 function test_skip
@@ -484,6 +517,612 @@ function test_verbose_error
 		"verbose_error_on_stderr.txt"
 }
 
+function test_check
+{
+	run "--check $G_TEST_FILE_WITH_ERR"
+	assert_ec 2
+	diff_stderr "exit_codes_err_stderr.txt"
+
+	# matchers and -V don't matter
+	run "--check -V -m 'one' $G_TEST_FILE_WITH_ERR"
+	assert_ec 2
+	diff_stderr "exit_codes_err_stderr.txt"
+
+	run_ok "--check $G_TEST_FILE_1 -C '//' -B '/*' -T '*/'"
+	diff_stdout "empty"
+
+	run "--check -n 'no-match' $G_TEST_FILE_1"
+	assert_ec 1
+	diff_stdout "empty"
+}
+
+function test_sub_line
+{
+	local L_JSON="./input/test_input_sub_line.json"
+	local L_XML="./input/test_input_sub_line.xml"
+	local L_SIZE=""
+
+	# the same output no matter where the lines are cut
+	for L_SIZE in 8 32 1K; do
+		run_ok "-g json -n '\"tags\"' --sub-line $L_SIZE -l $L_JSON"
+		diff_stdout "sub_line_json_tags.txt"
+
+		run_ok "-g json -n '{\"id\"' -m bob --sub-line $L_SIZE $L_JSON"
+		diff_stdout "sub_line_json_match.txt"
+
+		run_ok "-g json -r -n '\"meta\"|\"extra\"' -N --sub-line $L_SIZE $L_JSON"
+		diff_stdout "sub_line_json_names.txt"
+
+		run_ok "-g xml -n item -l --sub-line $L_SIZE $L_XML"
+		diff_stdout "sub_line_xml.txt"
+
+		run_ok "-g xml -n item -M a --sub-line $L_SIZE $L_XML"
+		diff_stdout "sub_line_xml_dont_match.txt"
+	done
+
+	run "--sub-line 1K -I $L_JSON"
+	assert_ec 2
+	diff_stderr "sub_line_ignore_top_stderr.txt"
+}
+
+function test_build_index
+{
+	local L_DIR="./input/build_index.tmp"
+	local L_FILE="$L_DIR/test_input_1.txt"
+	local L_ERR="$L_DIR/test_input_with_err.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+	bt_eval "cp $G_TEST_FILE_1 $G_TEST_FILE_WITH_ERR $L_DIR"
+
+	run "--build-index -n 'main' $L_FILE"
+	assert_ec 0
+	diff_stdout "empty"
+	bt_assert "[ -f $L_FILE.blkidx ]"
+
+	run_ok "-n 'main' $L_FILE"
+	diff_stdout "block_name_match_1_fixed.txt"
+
+	# the index is trusted while the file keeps its size, time, and inode, so
+	# the block found is the one it had when indexed
+	bt_eval "touch -r $L_FILE $L_DIR/ref"
+	bt_eval "sed 's/^main {/mian {/' $L_FILE > $L_DIR/new"
+	bt_eval "cat $L_DIR/new > $L_FILE"
+	bt_eval "touch -r $L_DIR/ref $L_FILE"
+	run_ok "-n 'main' $L_FILE"
+	diff_stdout "build_index_trusted.txt"
+
+	# not for another name, which lexes the file as it is
+	run_ok "-n 'mian' $L_FILE"
+	diff_stdout "build_index_other_name.txt"
+
+	# no index for a file with errors
+	run "--build-index $L_ERR"
+	assert_ec 2
+	bt_assert "[ ! -f $L_ERR.blkidx ]"
+
+	set_run_prefix "cat $G_TEST_FILE_1 |"
+	run "--build-index"
+	assert_ec 2
+	unset_run_prefix
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_index_trigrams
+{
+	local L_DIR="./input/index_trigrams.tmp"
+	local L_FILE="$L_DIR/test_input_1.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+	bt_eval "cp $G_TEST_FILE_1 $L_DIR"
+
+	run "--index-trigrams $L_FILE"
+	assert_ec 0
+	diff_stdout "empty"
+
+	run_ok "-m 'quick' -i -m 'brown' $L_FILE"
+	diff_stdout "index_trigrams_match.txt"
+
+	# an escape like \x69 is not text the block needs
+	run_ok "-r -m 'qu\\x69ck' $L_FILE"
+	diff_stdout "index_trigrams_match.txt"
+
+	# with the index trusted, a block which didn't have the text when it was
+	# indexed is not read
+	bt_eval "touch -r $L_FILE $L_DIR/ref"
+	bt_eval "sed 's/jumps Over/Brown Over/' $L_FILE > $L_DIR/new"
+	bt_eval "cat $L_DIR/new > $L_FILE"
+	bt_eval "touch -r $L_DIR/ref $L_FILE"
+	run_ok "-m 'Brown' $L_FILE"
+	diff_stdout "index_trigrams_match.txt"
+
+	run_ok "-r -m 'Brow+n' $L_FILE"
+	diff_stdout "index_trigrams_match.txt"
+
+	# all blocks are read when no text is known to be needed
+	run_ok "-r -m 'Brown|zzz' $L_FILE"
+	diff_stdout "index_trigrams_all_read.txt"
+
+	run_nok "-m 'zzz' $L_FILE"
+	diff_stdout "empty"
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_cache_dir
+{
+	local L_DIR="./input/cache_dir.tmp"
+	local L_CACHE="$L_DIR/cache"
+	local L_FILE="$L_DIR/test_input_1.txt"
+	local L_ERR="$L_DIR/test_input_with_err.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+	bt_eval "cp $G_TEST_FILE_1 $G_TEST_FILE_WITH_ERR $L_DIR"
+
+	run_ok "--cache-dir $L_CACHE -m 'Brown' $L_FILE"
+	diff_stdout "cache_dir_match.txt"
+	bt_assert "[ 1 -eq \$(ls $L_CACHE | wc -l) ]"
+
+	# an unchanged file is not matched again, the blocks are only printed
+	bt_eval "touch -r $L_FILE $L_DIR/ref"
+	bt_eval "sed 's/Brown Fox/Brxwn Fox/' $L_FILE > $L_DIR/new"
+	bt_eval "cat $L_DIR/new > $L_FILE"
+	bt_eval "touch -r $L_DIR/ref $L_FILE"
+	run_ok "--cache-dir $L_CACHE -m 'Brown' $L_FILE"
+	diff_stdout "cache_dir_unchanged.txt"
+
+	# another query is not answered from the cache
+	run_ok "--cache-dir $L_CACHE -m 'Brxwn' -w $L_FILE"
+	diff_stdout "cache_dir_file_name.txt"
+	bt_assert "[ 2 -eq \$(ls $L_CACHE | wc -l) ]"
+
+	# nor is a changed file
+	bt_eval "touch $L_FILE"
+	run "--cache-dir $L_CACHE -m 'Brown' $L_FILE"
+	assert_ec 1
+	diff_stdout "empty"
+
+	# errors are reported every time
+	run "--cache-dir $L_CACHE $L_ERR"
+	assert_ec 2
+	bt_assert "[ 2 -eq \$(ls $L_CACHE | wc -l) ]"
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_batch
+{
+	local L_QUERIES="./input/test_input_batch.txt"
+	local L_BAD="./input/test_input_batch_bad.txt"
+	local L_FILES="$G_TEST_FILE_1 $G_TEST_FILE_2"
+
+	run_ok "--batch $L_QUERIES $L_FILES"
+	diff_stdout "batch.txt"
+
+	set_run_prefix "cat $G_TEST_FILE_1 |"
+	run_ok "--batch $L_QUERIES"
+	diff_stdout "batch_stdin.txt"
+	unset_run_prefix
+
+	run "--batch $L_BAD $G_TEST_FILE_1"
+	assert_ec 2
+	diff_stderr "batch_bad_stderr.txt"
+
+	run "--batch $L_QUERIES -m 'x' $G_TEST_FILE_1"
+	assert_ec 2
+}
+
+function test_serve
+{
+	local L_DIR="./input/serve.tmp"
+	local L_SOCK="$L_DIR/sock"
+	local L_PID=""
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	run "--serve $L_SOCK $G_TEST_FILE_1"
+	assert_ec 2
+
+	bt_eval "$G_BLOCKS_BIN --serve $L_SOCK 2>/dev/null &"
+	L_PID="$!"
+	bt_eval "for i in \$(seq 50); do [ -S $L_SOCK ] && break; sleep 0.1; done"
+
+	# the same output and exit status as when run directly
+	run_ok "--client $L_SOCK -m 'Brown' -N $G_TEST_FILES_1_2"
+	diff_stdout "serve_match.txt"
+	run_ok "-m 'Brown' -N $G_TEST_FILES_1_2"
+	diff_stdout "serve_match.txt"
+
+	# every --client is left out, whichever way it's written
+	run_ok "--client $L_SOCK -m 'Brown' --client= $L_SOCK -N $G_TEST_FILES_1_2"
+	diff_stdout "serve_match.txt"
+
+	set_run_prefix "cat $G_TEST_FILE_1 |"
+	run_ok "--client=$L_SOCK -m 'Brown' -l"
+	diff_stdout "serve_stdin.txt"
+	unset_run_prefix
+
+	run "--client $L_SOCK -m 'xyzzy' $G_TEST_FILE_1"
+	assert_ec 1
+	diff_stdout "empty"
+
+	run "--client $L_SOCK -m 'Brown' ./input/no_such_file.txt"
+	assert_ec 2
+	diff_stderr "serve_no_file_stderr.txt"
+
+	# what a query compiled and mapped is kept for the next; a file changed
+	# after it was kept is read again
+	bt_eval "cp $G_TEST_FILE_1 $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN -m 'Brown' -l $L_DIR/in.txt > $L_DIR/direct.txt"
+	bt_eval "$G_BLOCKS_BIN --client $L_SOCK -m 'Brown' -l $L_DIR/in.txt \
+		> $L_DIR/first.txt"
+	bt_eval "$G_BLOCKS_BIN --client $L_SOCK -m 'Brown' -l $L_DIR/in.txt \
+		> $L_DIR/second.txt"
+	bt_diff_ok "$L_DIR/first.txt" "$L_DIR/direct.txt"
+	bt_diff_ok "$L_DIR/second.txt" "$L_DIR/direct.txt"
+
+	bt_eval "printf 'x {\n Brown\n}\n' >> $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN -m 'Brown' -l $L_DIR/in.txt > $L_DIR/direct.txt"
+	bt_eval "$G_BLOCKS_BIN --client $L_SOCK -m 'Brown' -l $L_DIR/in.txt \
+		> $L_DIR/first.txt"
+	bt_diff_ok "$L_DIR/first.txt" "$L_DIR/direct.txt"
+	bt_eval "$G_BLOCKS_BIN --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --client $L_SOCK -m 'Brown' -l $L_DIR/in.txt \
+		> $L_DIR/second.txt"
+	bt_diff_ok "$L_DIR/second.txt" "$L_DIR/direct.txt"
+
+	# a bad option never gets to the server
+	run "--client $L_SOCK --sub-line=x $G_TEST_FILE_1"
+	assert_ec 2
+
+	# only one server on a socket
+	run "--serve $L_SOCK"
+	assert_ec 2
+
+	bt_eval "kill $L_PID && wait $L_PID 2>/dev/null"
+	run "--client $L_SOCK -m 'Brown' $G_TEST_FILE_1"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_follow
+{
+	local L_DIR="./input/follow.tmp"
+	local L_FILE="$L_DIR/log.txt"
+	local L_OUT="$L_DIR/out.txt"
+	local L_ERR="$L_DIR/err.txt"
+	local L_PID=""
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+	bt_eval "printf 'a {\n 1\n}\nb {\n' > $L_FILE"
+
+	run "--follow -m '2' $L_FILE $L_FILE"
+	assert_ec 2
+	run "--follow -m '2' -W $L_FILE"
+	assert_ec 2
+
+	# the open block is finished by what's appended, then the file is
+	# truncated and read again from its start; the block left open is an
+	# error
+	bt_eval "$G_BLOCKS_BIN --follow -c 2 -m '2' -l $L_FILE >$L_OUT 2>$L_ERR &"
+	L_PID="$!"
+	bt_eval "sleep 0.3 && printf ' 2\n}\nc {\n' >> $L_FILE"
+	bt_eval "sleep 0.3 && : > $L_FILE"
+	bt_eval "sleep 0.3 && printf 'x { 2 }\n' >> $L_FILE"
+	bt_eval "for i in \$(seq 50); do kill -0 $L_PID 2>/dev/null || break; \
+		sleep 0.1; done"
+	bt_eval "kill $L_PID 2>/dev/null; wait $L_PID 2>/dev/null"
+	bt_diff_ok "$L_OUT" "accept/follow.txt"
+	bt_diff_ok "$L_ERR" "accept/follow_stderr.txt"
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_state_file
+{
+	local L_DIR="./input/state_file.tmp"
+	local L_STATE="$L_DIR/state"
+	local L_FILE="$L_DIR/log.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+	bt_eval "printf 'a {\n 1\n}\nb { 2 } c {\n' > $L_FILE"
+
+	# the open block is read again the next time
+	run "--state-file $L_STATE -l $L_FILE"
+	assert_ec 2
+	bt_diff_ok "$G_TEST_RESULT_STDOUT" "accept/state_file_first.txt"
+
+	bt_eval "printf ' 3\n}\nd { 4 }\n' >> $L_FILE"
+	run_ok "--state-file $L_STATE -l $L_FILE"
+	diff_stdout "state_file_appended.txt"
+
+	# nothing new
+	run "--state-file $L_STATE -l $L_FILE"
+	assert_ec 1
+	diff_stdout "empty"
+
+	# a replaced file is read from its start
+	bt_eval "cp $L_FILE $L_DIR/new && mv $L_DIR/new $L_FILE"
+	run_ok "--state-file $L_STATE -l -c 1 $L_FILE"
+	diff_stdout "state_file_replaced.txt"
+
+	run "--state-file $L_STATE --follow $L_FILE"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_shard
+{
+	local L_DIR="./input/shard.tmp"
+	local L_FILES="$G_TEST_FILE_1 $G_TEST_FILE_2 $G_TEST_FILE_3"
+	L_FILES="$L_FILES ./input/match_dont_match_multiple.txt ./input/trivial.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	# about the same bytes in each part, in the order of the files
+	run_ok "--shard 1/3 -w $L_FILES"
+	diff_stdout "shard_1.txt"
+	run_ok "--shard 2/3 -w $L_FILES"
+	diff_stdout "shard_2.txt"
+	run_ok "--shard 3/3 -w $L_FILES"
+	diff_stdout "shard_3.txt"
+
+	# the parts put together are a single run
+	bt_eval "$G_BLOCKS_BIN -N -l $L_FILES > $L_DIR/all.txt"
+	bt_eval "for i in 1 2 3 4 5 6; do \
+		$G_BLOCKS_BIN --shard \$i/6 -N -l $L_FILES; done > $L_DIR/parts.txt"
+	bt_diff_ok "$L_DIR/parts.txt" "$L_DIR/all.txt"
+
+	# an empty part doesn't read stdin
+	set_run_prefix "echo '{ }' |"
+	run "--shard 1/2 $G_TEST_FILE_1"
+	assert_ec 1
+	diff_stdout "empty"
+	unset_run_prefix
+
+	run "--shard 0/2 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--shard 3/2 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--shard 1-2 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--shard 1/99999999999999999999999 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--shard 1/2 - $G_TEST_FILE_1"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_range
+{
+	local L_DIR="./input/range.tmp"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	# starts inside main, so the block in it is not taken
+	run_ok "-l --line-range 37:49 $G_TEST_FILE_1"
+	diff_stdout "range_lines.txt"
+	run_ok "-l --byte-range 0:150 $G_TEST_FILE_1"
+	diff_stdout "range_bytes.txt"
+	run "--line-range 42:48 $G_TEST_FILE_1"
+	assert_ec 1
+	diff_stdout "empty"
+
+	# ranges which follow each other put together are a single run
+	bt_eval "$G_BLOCKS_BIN -l $G_TEST_FILE_1 > $L_DIR/all.txt"
+	bt_eval "for r in 0:50 50:150 150:; do \
+		$G_BLOCKS_BIN -l --byte-range \$r $G_TEST_FILE_1; done > $L_DIR/parts.txt"
+	bt_diff_ok "$L_DIR/parts.txt" "$L_DIR/all.txt"
+	bt_eval "for r in 1:7 8:40 41:; do \
+		$G_BLOCKS_BIN -l --line-range \$r $G_TEST_FILE_1; done > $L_DIR/parts.txt"
+	bt_diff_ok "$L_DIR/parts.txt" "$L_DIR/all.txt"
+
+	# the same from an index
+	bt_eval "cp $G_TEST_FILE_1 $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --build-index $L_DIR/in.txt"
+	run_ok "-l --line-range 37:49 $L_DIR/in.txt"
+	diff_stdout "range_lines.txt"
+	run_ok "-l --byte-range 0:150 $L_DIR/in.txt"
+	diff_stdout "range_bytes.txt"
+
+	run "--line-range 0:2 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--byte-range 5:3 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--byte-range 5 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--byte-range 5:x $G_TEST_FILE_1"
+	assert_ec 2
+	run "--byte-range 0:99999999999999999999999 $G_TEST_FILE_1"
+	assert_ec 2
+	run "--byte-range 0:5 --follow $G_TEST_FILE_1"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_output_jsonl
+{
+	local L_DIR="./input/output_jsonl.tmp"
+	local L_IN="./input/test_input_jsonl.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	run_ok "--output jsonl $G_TEST_FILE_1"
+	diff_stdout "output_jsonl.txt"
+
+	# quotes, back slashes, tabs, and control characters are escaped
+	run_ok "--output=jsonl --with-body -r -n '[a-z]+' $L_IN"
+	diff_stdout "output_jsonl_body.txt"
+	run_ok "--output jsonl --with-body -r -n '[a-z]+' -m in $L_IN"
+	diff_stdout "output_jsonl_match.txt"
+
+	# the same from an index
+	bt_eval "cp $L_IN $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN -r -n '[a-z]+' --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --output jsonl --with-body -r -n '[a-z]+' \
+		$L_DIR/in.txt | sed 's|$L_DIR/in.txt|$L_IN|' > $L_DIR/fixed.txt"
+	bt_diff_ok "$L_DIR/fixed.txt" "./accept/output_jsonl_body.txt"
+
+	run "--output xml $G_TEST_FILE_1"
+	assert_ec 2
+	run "--with-body $G_TEST_FILE_1"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_offsets
+{
+	local L_DIR="./input/offsets.tmp"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	run_ok "--offsets $G_TEST_FILE_1"
+	diff_stdout "offsets.txt"
+	run_ok "--output=offsets $G_TEST_FILE_1"
+	diff_stdout "offsets.txt"
+
+	# matched while parsed, -k and -c still count
+	run_ok "--offsets -M Fox -k 1 -c 2 $G_TEST_FILE_1"
+	diff_stdout "offsets_match.txt"
+
+	# the offsets cut the blocks out of the file
+	bt_eval "$G_BLOCKS_BIN --offsets $G_TEST_FILE_1 | \
+		while read f b e l1 l2; do \
+			tail -c +\$((b+1)) \$f | head -c \$((e-b)); echo; \
+		done > $L_DIR/cut.txt"
+	bt_eval "$G_BLOCKS_BIN --sub-line 4K $G_TEST_FILE_1 > $L_DIR/sub.txt"
+	bt_diff_ok "$L_DIR/cut.txt" "$L_DIR/sub.txt"
+
+	# the same from an index
+	bt_eval "cp $G_TEST_FILE_1 $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --offsets -M Fox -k 1 -c 2 $L_DIR/in.txt | \
+		sed 's|$L_DIR/in.txt|$G_TEST_FILE_1|' > $L_DIR/idx.txt"
+	bt_diff_ok "$L_DIR/idx.txt" "./accept/offsets_match.txt"
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_count
+{
+	local L_DIR="./input/count.tmp"
+	local L_FILES="$G_TEST_FILE_1 $G_TEST_FILE_2 ./input/trivial.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	run_ok "--count $L_FILES"
+	diff_stdout "count.txt"
+
+	# a file without blocks gets its line
+	run_ok "--count --count-total -m Fox $L_FILES"
+	diff_stdout "count_match.txt"
+	run "--count -m nothing_like_it $L_FILES"
+	assert_ec 1
+	run_ok "--count -c 2 -k 1 $G_TEST_FILE_1"
+	diff_stdout "count_skip.txt"
+
+	set_run_prefix "echo '{ } { }' |"
+	run_ok "--count"
+	diff_stdout "count_stdin.txt"
+	unset_run_prefix
+
+	# the same from an index
+	bt_eval "cp $G_TEST_FILE_1 $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --count -c 2 -k 1 $L_DIR/in.txt | \
+		sed 's|$L_DIR/in.txt|$G_TEST_FILE_1|' > $L_DIR/idx.txt"
+	bt_diff_ok "$L_DIR/idx.txt" "./accept/count_skip.txt"
+
+	run "--count -w $G_TEST_FILE_1"
+	assert_ec 2
+	run "--count-total $G_TEST_FILE_1"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_group_by_name
+{
+	local L_DIR="./input/group_by_name.tmp"
+	local L_IN="./input/test_input_group.txt"
+	local L_FILES="./input/test_input_jsonl.txt $L_IN"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	# a tie for the file with the most goes to the one read first
+	run_ok "-r -n '[a-z]+' --group-by-name $L_FILES"
+	diff_stdout "group_by_name.txt"
+	run_ok "-r -n '[a-z]+' --group-by-name -c 3 $L_FILES"
+	diff_stdout "group_by_name_count.txt"
+	run "-r -n '[a-z]+' --group-by-name -m nothing_like_it $L_FILES"
+	assert_ec 1
+
+	# the same from an index
+	bt_eval "cp $L_IN $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN -r -n '[a-z]+' --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN -r -n '[a-z]+' --group-by-name \
+		./input/test_input_jsonl.txt $L_DIR/in.txt | \
+		sed 's|$L_DIR/in.txt|$L_IN|' > $L_DIR/idx.txt"
+	bt_diff_ok "$L_DIR/idx.txt" "./accept/group_by_name.txt"
+
+	run "--group-by-name -w $L_IN"
+	assert_ec 2
+	run "--group-by-name --check $L_IN"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
+function test_top_k
+{
+	local L_DIR="./input/top_k.tmp"
+	local L_FILES="$G_TEST_FILE_1 ./input/test_input_group.txt"
+
+	bt_eval "rm -rf $L_DIR && mkdir $L_DIR"
+
+	# the blocks are read back from the files, biggest first
+	run_ok "--top-k 3 $L_FILES"
+	diff_stdout "top_k.txt"
+	run_ok "--top-k 2 --by bytes -l -N $L_FILES"
+	diff_stdout "top_k_bytes.txt"
+	run_ok "--top-k 2 --output jsonl $L_FILES"
+	diff_stdout "top_k_jsonl.txt"
+	run "--top-k 2 -m nothing_like_it $L_FILES"
+	assert_ec 1
+
+	# stdin cannot be read back, only where its blocks are printed
+	set_run_prefix "(echo '{ }'; echo '{'; echo '}') |"
+	run_ok "--top-k 1 --offsets"
+	diff_stdout "top_k_stdin.txt"
+	run "--top-k 1"
+	assert_ec 2
+	unset_run_prefix
+
+	# the same from an index
+	bt_eval "cp $G_TEST_FILE_1 $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --build-index $L_DIR/in.txt"
+	bt_eval "$G_BLOCKS_BIN --top-k 3 $L_DIR/in.txt ./input/test_input_group.txt \
+		> $L_DIR/idx.txt"
+	bt_diff_ok "$L_DIR/idx.txt" "./accept/top_k.txt"
+
+	run "--by bytes $L_FILES"
+	assert_ec 2
+	run "--top-k 0 $L_FILES"
+	assert_ec 2
+	run "--top-k 99999999999999999999999 $L_FILES"
+	assert_ec 2
+	run "--top-k 1 --count $L_FILES"
+	assert_ec 2
+
+	bt_eval "rm -rf $L_DIR"
+}
+
 function test_debug_base
 {
 	run_ok "-D"
@@ -780,6 +1419,15 @@ function test_lang_c
 
 	run_ok "-g C -n main $L_FILE"
 	diff_stdout "lang_c_ok.txt"
+
+	L_FILE="./input/test_input_lang_c_literals.txt"
+
+	# char literals, raw strings, continuations, directives
+	run_ok "-g C -n main $L_FILE"
+	diff_stdout "lang_c_ok_2.txt"
+
+	run_ok "-g C -Nl $L_FILE"
+	diff_stdout "lang_c_ok_3.txt"
 }
 
 function test_lang_awk
@@ -899,6 +1547,16 @@ function test_lang_xml
 
 	run_ok "-Nl -g xml -n 'to|from' $L_FILE"
 	diff_stdout "lang_xml_ok_2.txt"
+
+	L_FILE="./input/test_input_lang_xml_tags.txt"
+
+	# self-closing, cdata, processing instructions, quoted attributes
+	run_ok "-Nl -g xml $L_FILE"
+	diff_stdout "lang_xml_ok_3.txt"
+
+	# whole tag names only
+	run_ok "-Nl -g xml -n to $L_FILE"
+	diff_stdout "lang_xml_ok_4.txt"
 }
 
 function test_lang_info
@@ -965,6 +1623,22 @@ function test_flags
 	bt_eval test_no_defaults
 	bt_eval test_fatal_error
 	bt_eval test_verbose_error
+	bt_eval test_check
+	bt_eval test_sub_line
+	bt_eval test_build_index
+	bt_eval test_index_trigrams
+	bt_eval test_cache_dir
+	bt_eval test_batch
+	bt_eval test_serve
+	bt_eval test_follow
+	bt_eval test_state_file
+	bt_eval test_shard
+	bt_eval test_range
+	bt_eval test_output_jsonl
+	bt_eval test_offsets
+	bt_eval test_count
+	bt_eval test_group_by_name
+	bt_eval test_top_k
 	bt_eval test_debug
 	bt_eval test_closest_name_to_block
 	bt_eval test_no_strings
@@ -1200,6 +1874,28 @@ function test_exit_codes
 	assert_ec 2
 	diff_stdout_stderr "exit_codes_err_stdout.txt" "exit_codes_err_stderr.txt"
 
+	# a block rejected early still has its nesting checked
+	run "-M 'err' $G_TEST_FILE_WITH_ERR"
+	assert_ec 2
+	diff_stdout_stderr "exit_codes_err_stdout.txt" "exit_codes_err_stderr.txt"
+
+	run "-V -M 'err' $G_TEST_FILE_WITH_ERR"
+	assert_ec 2
+	diff_stdout_stderr "verbose_error_on_stdout.txt" \
+		"verbose_error_on_stderr.txt"
+
+	run "-V -M 'err' --max-block-memory 1 $G_TEST_FILE_WITH_ERR"
+	assert_ec 2
+	diff_stdout_stderr "verbose_error_on_stdout.txt" \
+		"verbose_error_on_stderr.txt"
+
+	# a block in error too big to hold back is flagged instead of dropped
+	set_run_prefix "awk 'BEGIN {print \"big {\"; for (i = 0; i < 20000; ++i) print i}' |"
+	run ""
+	assert_ec 2
+	bt_diff_ok "$G_TEST_RESULT_STDERR" "accept/exit_codes_err_partial_stderr.txt"
+	unset_run_prefix
+
 	run "no-file"
 	assert_ec 2
 	diff_stderr "exit_codes_no_file_err.txt"